@@ -2,6 +2,7 @@
 #define SHADER_H
 
 #include <string>
+#include <vector>
 #include <stb_image.h>
 #include <glad/glad.h>
 
@@ -18,18 +19,55 @@ public:
 	void free();
 };
 
+// Regions of a streaming VBO: the CPU fills one while the GPU may still be
+// reading the two others
+#define STREAM_REGION_NUM 3
+
 class VertexBufferObject
 {
 public:
 	GLuint id;
 	int attrib_num;
 
+	// Streaming mode (see init_stream); region is the one last written
+	bool is_streaming = false;
+	bool is_persistent = false;
+	GLsizeiptr region_bytes = 0;
+	int region = 0;
+	void *mapped = nullptr;
+	GLsync fences[STREAM_REGION_NUM] = {};
+
     void init();
 
 	// Updates the VBO with a 1D array M
 	void update(const GLfloat *M, int size, int attr_num);
     void update(const GLint *M, int size, int attr_num);
 
+	// Overwrite size floats of the VBO from float first on, keeping the rest
+	void update_range(const GLfloat *M, int first, int size);
+
+	// Turn the VBO into a ring of STREAM_REGION_NUM regions of max_size floats
+	// each, rewritten every frame. The storage is mapped once and stays mapped
+	// if the context has buffer storage (GL 4.4 or ARB_buffer_storage);
+	// otherwise each region is written with glBufferSubData
+	void init_stream(int max_size, int attr_num);
+
+	// Move on to the next region; waits only if the GPU still reads it. The
+	// region keeps what was written to it three frames ago
+	void next_region();
+
+	// Write size floats from float first on in the current region
+	void write(const GLfloat *M, int first, int size);
+
+	// Write M at the start of the next region
+	void stream(const GLfloat *M, int size);
+
+	// Byte offset of the region last written, to use as the attribute offset
+	GLintptr offset() const;
+
+	// Mark the end of the draws reading the region last written
+	void fence();
+
 	// Select this VBO for subsequent draw calls
 	void bind();
 
@@ -52,6 +90,39 @@ public:
 	void free();
 };
 
+// An active uniform or attribute of a linked program, as found by Program::init
+struct ProgramVariable
+{
+	std::string name;
+	GLint location;
+	// GL type of the variable (GL_FLOAT_VEC4...) and its array size
+	GLenum type;
+	GLint size;
+};
+
+// Location of a uniform, resolved once; -1 if the program has no such uniform,
+// in which case GL ignores the updates
+class UniformHandle
+{
+public:
+	GLint location = -1;
+	GLenum type = 0;
+	GLint size = 0;
+
+	bool valid() const { return location >= 0; }
+};
+
+// Location of a vertex attribute, resolved once; -1 if the program has no
+// such attribute
+class AttribHandle
+{
+public:
+	GLint location = -1;
+	GLenum type = 0;
+
+	bool valid() const { return location >= 0; }
+};
+
 // This class wraps an OpenGL program composed of two shaders
 class Program
 {
@@ -61,6 +132,12 @@ public:
 	GLuint geometry_shader;
 	GLuint program_shader;
 
+	// Active uniforms and attributes, listed once when the program is linked
+	// so that no name is looked up in GL afterwards. Arrays are listed under
+	// their plain name
+	std::vector<ProgramVariable> uniforms;
+	std::vector<ProgramVariable> attributes;
+
 	Program();
 
 	// Create a new shader from the specified source strings
@@ -80,8 +157,20 @@ public:
 	// Return the OpenGL handle of a uniform attribute (-1 if it does not exist)
 	GLint uniform(const std::string &name) const;
 
+	// The same as handles, to resolve once and keep for the draw loop
+	AttribHandle attrib_handle(const std::string &name) const;
+	UniformHandle uniform_handle(const std::string &name) const;
+
 	// Bind a per-vertex array attribute
 	GLint bindVertexAttribArray(const std::string &name, VertexBufferObject& VBO) const;
+	void bindVertexAttribArray(AttribHandle attrib, VertexBufferObject& VBO) const;
+
+	// Bind a per-instance attribute of size floats, read from float first of
+	// records of stride floats
+	GLint bindInstanceAttribArray(const std::string &name, VertexBufferObject& VBO,
+		int size, int stride, int first) const;
+	void bindInstanceAttribArray(AttribHandle attrib, VertexBufferObject& VBO,
+		int size, int stride, int first) const;
 
 	GLuint create_shader_helper(GLint type, const std::string &shader_string);
 
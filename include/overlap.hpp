@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <limits>
+#include <glm/glm.hpp>
+
+// Most boxes tested by one overlap_batch call
+#define OVERLAP_BATCH_MAX 32
+// Boxes compared at once by the widest overlap_batch loop
+#define OVERLAP_BATCH_LANES 8
+
+// Boxes in structure-of-arrays layout, so they can be compared four or eight
+// at a time
+struct Box_Batch
+{
+    int num = 0;
+    alignas(32) float min_x[OVERLAP_BATCH_MAX];
+    alignas(32) float min_y[OVERLAP_BATCH_MAX];
+    alignas(32) float max_x[OVERLAP_BATCH_MAX];
+    alignas(32) float max_y[OVERLAP_BATCH_MAX];
+
+    void add(glm::vec2 box_min, glm::vec2 box_max)
+    {
+        min_x[num] = box_min.x;
+        min_y[num] = box_min.y;
+        max_x[num] = box_max.x;
+        max_y[num] = box_max.y;
+        num++;
+    }
+
+    // Fill the lanes after the last box up to a whole vector with boxes that
+    // overlap nothing, so overlap_batch never reads uninitialized floats
+    void pad()
+    {
+        const float inf = std::numeric_limits<float>::infinity();
+        for (int k = num; k < OVERLAP_BATCH_MAX && k % OVERLAP_BATCH_LANES != 0; k++) {
+            min_x[k] = inf;
+            min_y[k] = inf;
+            max_x[k] = -inf;
+            max_y[k] = -inf;
+        }
+    }
+};
+
+// Test a box against every box of the batch; bit k of the result is set if
+// the box overlaps box k. Boxes only touching along an edge don't overlap,
+// as in Unit::is_overlap. Uses AVX when the compiler targets it, SSE2 on
+// other x86 builds and plain comparisons elsewhere; pad the batch first
+uint32_t overlap_batch(glm::vec2 box_min, glm::vec2 box_max, const Box_Batch &batch);
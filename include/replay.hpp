@@ -0,0 +1,46 @@
+#pragma once
+
+#include "world.hpp"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// A recorded match: the seed, the map it was played on, the player input of
+// every tick and periodic state hashes to detect desyncs on playback.
+//
+// File layout (integers are LEB128 varints unless noted):
+//   "TNKR" magic, format version
+//   seed, map hash (8 bytes, little endian), ticks per second, enemy num,
+//   enemy total, bullet num, broadphase, hash cell size, hash interval,
+//   tick count
+//   input runs: run count, then (run length << INPUT_BITS | input bits) per run
+//   state hashes: hash count, then 4 bytes little endian per hash
+class Replay
+{
+public:
+    uint64_t seed = 0;
+    uint64_t map_hash = 0;
+    World_Config config;
+
+    // The simulation rate the match was played at; a replay only plays back
+    // in a build with the same TICKS_PER_SECOND
+    int ticks_per_second = TICKS_PER_SECOND;
+
+    // A state hash is stored after every hash_interval ticks
+    int hash_interval = 1;
+
+    std::vector<unsigned char> inputs;
+    std::vector<uint32_t> hashes;
+
+    // Reset the replay to record a match that was just initialized
+    void start(World &world, uint64_t seed, int hash_interval);
+
+    // Append the input of a tick; call right after world.step(input)
+    void record(const Input &input, World &world);
+
+    bool save(std::string filename);
+    bool load(std::string filename);
+
+    // Expected state hash after the given number of ticks, if one was stored
+    bool expected_hash(int64_t ticks, uint32_t &hash);
+};
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <cstdint>
+
+// xoshiro256** generator; small, fast and fully determined by its seed
+// ref: http://prng.di.unimi.it/
+class Rng
+{
+public:
+    uint64_t s[4];
+
+    // Expand a 64-bit seed into the generator state with splitmix64
+    void seed(uint64_t seed);
+
+    uint64_t next();
+
+    // Uniform integer in [0, n)
+    int uniform(int n);
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "helpers.hpp"
+#include "types.hpp"
+#include <vector>
+
+// Sprites the batch makes room for at first; it doubles when a frame needs more
+#define SPRITE_BATCH_MIN_NUM 1024
+
+// Draws the visible map blocks, tanks and bullets of a frame as instances of
+// one unit quad, in a single call. The sprites are streamed through a ring of
+// regions: the visible blocks first, then the units. The blocks are kept in a
+// packed list updated from the blocks that changed, and written to a region
+// only when it holds an older copy of them. Only used by Tank2017 --instanced:
+// with a software renderer it is slower than the geometry shader path
+class Sprite_Batch
+{
+public:
+    VertexArrayObject vao;
+    VertexBufferObject vbo_quad;
+    VertexBufferObject vbo_sprite;
+
+    // Per-instance attributes of the program, re-pointed every frame
+    AttribHandle attrib_rect;
+    AttribHandle attrib_tile;
+    AttribHandle attrib_depth;
+    AttribHandle attrib_direction;
+
+    // Sprites the stream has room for
+    int capacity = 0;
+
+    // Visible blocks, and where each block is in there (-1 if hidden)
+    std::vector<Sprite> map_sprite;
+    std::vector<int> map_block;
+    std::vector<int> map_pos;
+
+    // Bumped when map_sprite changes; the copy held by each region
+    uint64_t map_version = 1;
+    uint64_t region_version[STREAM_REGION_NUM] = {};
+
+    // Sprites drawn by the last draw
+    int num = 0;
+
+    // Set the texture tiles of the program and allocate the buffers
+    void init(Program &program, std::vector<glm::mat2> &texture_mapping);
+
+    // Draw the map and the battle, blended from battle.prev_pose
+    void draw(Program &program, Map &map, Battle &battle, float alpha);
+
+    void free();
+
+private:
+    // Bring map_sprite up to date with the blocks that changed
+    void update_map(Map &map);
+
+    // Make room for num sprites in each region
+    void reserve(int num);
+};
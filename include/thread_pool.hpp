@@ -0,0 +1,37 @@
+#pragma once
+
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Runs a batch of independent jobs on a fixed set of threads. Every worker has
+// its own job queue and, once it runs dry, steals from the other workers.
+class Work_Stealing_Pool
+{
+public:
+    int thread_num;
+
+    // Number of jobs each worker ran and stole during the last run
+    std::vector<int> jobs_done;
+    std::vector<int> jobs_stolen;
+
+    // thread_num <= 0 means one thread per hardware core
+    explicit Work_Stealing_Pool(int thread_num);
+
+    // Call job(index, worker) for every index in [0, job_num); returns once all are done
+    void run(int job_num, const std::function<void(int, int)> &job);
+
+private:
+    struct Queue
+    {
+        std::mutex lock;
+        std::deque<int> jobs;
+    };
+
+    std::vector<Queue> queues;
+
+    bool pop_local(int worker, int &job);
+    bool steal(int worker, int &job);
+    void work(int worker, const std::function<void(int, int)> &job);
+};
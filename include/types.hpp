@@ -3,22 +3,42 @@
 #include "utils.hpp"
 #include <string>
 #include <vector>
-#include <map>
-#include <set>
+#include <algorithm>
+#include <cmath>
 #include <glm/glm.hpp>
 
 #define SCREEN_WIDTH 1024
 #define SCREEN_HEIGHT 768
-#define BOARD_SIZE 11
-#define MAP_ROWS BOARD_SIZE
-#define MAP_COLS BOARD_SIZE
+#define MAP_MAX_SIZE 4096
 #define TANK_USER_NUM 1
+// Default number of enemies on the field at the same time, and in total
 #define TANK_ENEMY_NUM 3
 #define TANK_ENEMY_MAX_NUM 10
-#define TANK_NUM (TANK_USER_NUM + TANK_ENEMY_NUM)
-#define TANK_WIDTH_DELTA 0.02f
+#define TANK_WIDTH_DELTA 0.11f
+
+// Unit ids inside a world: the kind of unit in the high bits, its index below.
+// Map blocks use their row-major index, so the id is the index itself
+#define UNIT_ID_TANK (1 << 28)
+#define UNIT_ID_BULLET (2 << 28)
+#define UNIT_ID_INDEX_MASK ((1 << 28) - 1)
+
+// What a map block stops (see Map::block_solid)
+#define BLOCK_STOPS_TANK 0x01
+#define BLOCK_STOPS_BULLET 0x02
+
+// Reference to a tank or a bullet that can be kept across ticks. Every spawn
+// into a pool slot bumps the slot generation, so a handle to a unit that has
+// died, or whose slot was reused, no longer resolves
+struct Unit_Handle
+{
+    int id = -1;
+    uint32_t generation = 0;
+};
 
-const static float BLOCK_WIDTH = 2.0f / BOARD_SIZE;
+// Game coordinates are measured in blocks: x grows to the right from the left
+// edge of the map and y grows downwards from the top edge. Block corners are
+// whole numbers, so they stay exact on any map size
+const static float BLOCK_WIDTH = 1.0f;
 const static float TANK_MOVE_STEP = BLOCK_WIDTH * 1.5f; 
 const static float TANK_WIDTH = BLOCK_WIDTH - TANK_WIDTH_DELTA * 2;
 const static float BULLET_WIDTH = BLOCK_WIDTH * 0.15f;
@@ -46,15 +66,52 @@ enum class Direction
     left = 3,
 };
 
+// Blocks [first, first + num) of a map
+struct Block_Range
+{
+    int first;
+    int num;
+};
+
+// A unit as drawn by the instanced renderer: its box in normalized device
+// coordinates (upper left corner, then lower right), its atlas tile (the
+// Unit_Type), its depth and its Direction. Only floats, so the array can be fed
+// straight to the per-instance attributes
+struct Sprite
+{
+    float rect[4];
+    float tile;
+    float depth;
+    float direction;
+};
+#define SPRITE_FLOATS 7
+
+// Where a unit stood at the start of a tick, all the rendering needs to blend
+// it towards where it stands now
+struct Unit_Pose
+{
+    glm::vec2 box_min;
+    glm::vec2 box_max;
+    Direction direction;
+    bool is_visible;
+};
+
+class Map;
+
 class Unit
 {
 public:
+    // Kind and slot of the unit (see UNIT_ID_TANK), fixed for the slot's life
     int id;
+    // Bumped each time the slot is (re)spawned
+    uint32_t generation;
 	Unit_Type type;
     Direction direction;
     bool is_visible;
-	glm::vec2 upleft;
-	glm::vec2 downright;
+
+    // Axis aligned box in game coordinates, the same whatever the facing
+    glm::vec2 box_min;
+    glm::vec2 box_max;
 
     Unit();
 
@@ -62,11 +119,15 @@ public:
 
     bool change_direction(Direction direction);
 
-    void move(float step);
+    // Move forward, stopping at the edges of the map
+    void move(float step, const Map &map);
 
-    bool is_overlap(Unit &unit);
+    bool is_overlap(const Unit &unit) const;
+
+    // Corners of the sprite turned to face the direction: the texture's upper
+    // left corner lands on upleft and its lower right one on downright
+    void get_corners(glm::vec2 &upleft, glm::vec2 &downright) const;
 };
-static int unit_id_factory = 0;
 
 class Tank : public Unit
 {
@@ -77,63 +138,411 @@ public:
 class Bullet : public Unit
 {
 public:
-    Unit_Type owner_type;
+    Unit_Type owner_type = Unit_Type::tank_enemy;
+    // Index of the tank that fired it
+    int owner = -1;
+
+    Bullet();
 
     void init(Tank tank);
 };
 
+// Tanks and bullets of a match. The pools are sized once in init and keep
+// their slots, dead units included: tank 0 is the user, then the enemies.
+// Bullet slots are handed out from a free list, and the live ones are packed
+// in bullet_live so the game only iterates bullets in flight. None of the
+// arrays grows after init, so playing never allocates
 class Battle
 {
 public:
-    float vert[TANK_NUM * 2 * 6];
-    float texc[TANK_NUM * 2 * 4];
+    // Rendering data: all the tanks, then all the bullet slots
+    std::vector<float> vert;
+    std::vector<float> texc;
+
+    // Instanced rendering data: the visible tanks, then the visible bullets,
+    // packed at the front
+    std::vector<Sprite> sprite;
+
+    // The tanks then the bullets as they were at the start of the current
+    // tick; sized by init, so saving them each tick never allocates
+    std::vector<Unit_Pose> prev_pose;
+
+    std::vector<Tank> tank;
+    std::vector<Bullet> bullet;
 
-    Tank tank[TANK_NUM];
-    Bullet bullet[TANK_NUM];
+    // Bullets each tank may have in flight at the same time
+    int bullet_max = 1;
 
+    // Live bullet slots in the first bullet_live_num entries, and the position
+    // of each slot in there (-1 if it is free)
+    std::vector<int> bullet_live;
+    std::vector<int> bullet_live_pos;
+    int bullet_live_num = 0;
+
+    // Free bullet slots, used as a stack
+    std::vector<int> bullet_free;
+    int bullet_free_num = 0;
+
+    // Bullets in flight per tank
+    std::vector<int> tank_bullet_num;
+
+    // Blocks where enemies appear, as row * cols + col
+    std::vector<int> spawn_block;
+
+    int enemy_max = TANK_ENEMY_NUM;
+    int enemy_total = TANK_ENEMY_MAX_NUM;
     int enemy_num = 0;
     int enemy_left = TANK_ENEMY_MAX_NUM;
 
-    void init();
+    // Make room for enemy_max enemies at a time out of enemy_total, each
+    // having up to bullet_max bullets in flight
+    void init(const Map &map, int enemy_max, int enemy_total, int bullet_max);
+
+    int tank_num() const;
+
+    // Take a free bullet slot for the given tank; -1 if the tank has all its
+    // bullets in flight
+    int spawn_bullet(int tank_idx);
+
+    // Give a bullet slot back to the pool; this moves the last live bullet
+    // into its place in bullet_live
+    void despawn_bullet(int slot);
 
     void init_texc(std::vector<glm::mat2> &texture_mapping);
 
-    void refresh_data();
+    // Remember where every tank and bullet is, before a tick moves them
+    void save_poses();
+
+    void refresh_data(const Map &map);
+
+    // Same as refresh_data, but blends the positions from prev_pose
+    void refresh_data(const Map &map, float alpha);
+
+    // Fill sprite instead of vert; returns how many units are visible
+    int refresh_sprites(const Map &map, float alpha);
 
     void print();
 };
 
+// The map size comes from the map file; blocks are stored compactly, one byte
+// per property, so memory only grows with the size of the loaded map
 class Map
 {
 public:
-	float vert[MAP_ROWS * MAP_COLS * 2 * 6];
-	float texc[MAP_ROWS * MAP_COLS * 2 * 2];
+    int rows = 0;
+    int cols = 0;
+
+    // Terrain of each block in row-major order, and whether it is still standing
+    std::vector<unsigned char> block_type;
+    std::vector<unsigned char> block_visible;
+
+    // Collision layer of the terrain: the BLOCK_STOPS_* bits of each block,
+    // cleared when the block is destroyed. Terrain never enters the collision
+    // grid; it is looked up here from the coordinates
+    std::vector<unsigned char> block_solid;
 
-    Unit block[MAP_ROWS][MAP_COLS];
+    // The same layer as bitboards, one per BLOCK_STOPS_* bit: each row of
+    // blocks takes mask_words words, block (row, col) being bit col % 64 of
+    // word row * mask_words + col / 64. A box is checked with a few ANDs
+    int mask_words = 0;
+    std::vector<uint64_t> tank_mask;
+    std::vector<uint64_t> bullet_mask;
+
+    // Rendering data, only allocated once the map is drawn
+    std::vector<float> vert;
+    std::vector<float> texc;
+
+    // Instanced rendering data: one per block, hidden blocks with an empty rect
+    std::vector<Sprite> sprite;
+
+    // Blocks changed since the rendering data was last refreshed; all of them
+    // after the map is loaded or restored, in which case they are not listed
+    std::vector<int> dirty_blocks;
+    bool is_all_dirty = true;
+
+    // Blocks rewritten by the last refresh, sorted and merged; empty on most
+    // frames
+    std::vector<Block_Range> block_changed;
 
 	void init_texc(std::vector<glm::mat2> &texture_mapping);
 
-	void read_map(std::string filename);
+	// Load the layout from a text file: the size, then one type per block;
+	// false with a message on a missing or malformed file
+	bool read_map(std::string filename);
+
+    // Column of the user tank on the bottom row, the fourth one when it fits
+    int user_spawn_col() const;
+
+    // The block at the given position as a unit; its id is row * cols + col
+    Unit block(int row, int col) const;
 
-    bool has_reached_edge(Unit &unit);
+    // Hash of the map layout as loaded, to check a replay against its map
+    uint64_t hash();
 
+    bool has_reached_edge(const Unit &unit) const;
+
+    // Set the BLOCK_STOPS_* bits of a block, keeping the masks in step
+    void set_solid(int id, unsigned char stops);
+
+    // Take a destroyed block off the collision layer and the rendering
+    void destroy_block(int id);
+
+    // True if the unit overlaps any block with one of the BLOCK_STOPS_* bits
+    bool is_blocked(const Unit &unit, unsigned char stops) const;
+
+    // is_blocked for up to 64 units at once: bit k is set if *units[k] is blocked
+    uint64_t blocked_units(const Unit *const *units, int num, unsigned char stops) const;
+
+    // Walk the lines of blocks swept by the unit moving dist forward, in the
+    // order it meets them, starting with those it already overlaps (a DDA along
+    // its axis). Returns how far it gets before overlapping a block with any of
+    // the BLOCK_STOPS_* bits, writing the blocks met there to ids; returns dist
+    // and no ids if the path is clear
+    float sweep_solid_blocks(const Unit &unit, float dist, unsigned char stops,
+        int ids[4], int &id_num) const;
+
+    // Convert game coordinates to normalized device coordinates
+    glm::vec2 to_screen(glm::vec2 pos) const;
+
+    // Rewrite the vertices of the dirty blocks only, listing them in
+    // block_changed
     void refresh_data();
 
+    // Same for the sprites; a map is drawn with either, not both
+    void refresh_sprites();
+
 	void print();
+
+private:
+    // Call refresh(idx) for every dirty block, or all of them, and list them
+    template<typename Refresh>
+    void refresh_dirty(bool is_resized, Refresh refresh);
+
+    void refresh_block(size_t idx);
+    void refresh_sprite(size_t idx);
+};
+
+// Cell membership of one unit, linked with the other members of the cell
+struct Grid_Node
+{
+    int id;
+    int next;
+    // Upper left cell of the unit, so a query can tell from which of its
+    // cells to report it
+    int first;
 };
 
-class Collision_Grid
+// Linked lists of the units in each cell of a regular grid over the map.
+// Stores unit ids rather than pointers, so it can be copied with its owner.
+// Every node is allocated by init and chained in the free list, so put and
+// remove never touch the heap. Collision_Grid and Spatial_Hash only differ in
+// where they keep the first node of each cell; Cells provides
+//   int cell_head(int cell) const: first node of the cell, -1 if empty
+//   int &claim_head(int cell): the same, making room for the cell if needed
+//   void release_cell(int cell): the last node of the cell was unlinked
+template<typename Cells>
+class Cell_Lists
 {
 public:
-    std::map<int, Unit*> grid[MAP_ROWS * MAP_COLS];
+    // Size of the grid in cells, and width of a cell
+    int rows = 0;
+    int cols = 0;
+    float cell_width = BLOCK_WIDTH;
+
+    // Nodes of all the cells; the unused ones are chained from free_node
+    std::vector<Grid_Node> node;
+    int free_node = -1;
+
+    // Statistics: cell memberships linked or unlinked, and the ones update
+    // skipped because the unit stayed in those cells
+    int64_t write_num = 0;
+    int64_t saved_write_num = 0;
+
+    int get_grid_index(float x, float y) const;
+
+    // Cells touched by the unit, without duplicates; returns how many (at most 4)
+    int get_cells_touched(const Unit &unit, bool by_center, int cells[4]) const;
+
+    // True if the unit is a member of the cell
+    bool contains(int cell, int id) const;
 
-    int get_grid_index(float x, float y);
-    std::set<int> get_grids_touched(Unit &unit, bool by_center);
+    // Call visit(id) once for each other unit in the cells under the given
+    // unit's box; stops and returns false as soon as visit returns false.
+    // visit must not change the grid
+    template<typename Visit>
+    bool query(const Unit &unit, Visit visit) const;
 
     void put(Unit &unit, bool by_center);
     void remove(Unit &unit, bool by_center);
 
-    std::vector<Unit*> check_collision(Unit &unit);
+    // Move a unit put by its corners from where it was to where it is now,
+    // only touching the cells it left or entered
+    void update(const Unit &before, Unit &unit);
+
+protected:
+    // node_num should cover every membership at once: one per unit put by
+    // center, up to four per unit put by its corners
+    void init_nodes(int rows, int cols, float cell_width, int node_num);
+
+private:
+    const Cells &cells() const { return static_cast<const Cells&>(*this); }
+    Cells &cells() { return static_cast<Cells&>(*this); }
+
+    void link(int cell, int id, int first);
+    void unlink(int cell, int id);
+
+    // Point the node of the unit in the cell to its new upper left cell
+    void set_first(int cell, int id, int first);
+};
+
+// One cell per map block, with the first node of every cell in an array
+class Collision_Grid : public Cell_Lists<Collision_Grid>
+{
+public:
+    // First node of each cell, -1 if the cell is empty
+    std::vector<int> head;
+
+    void init(int rows, int cols, int node_num);
+
+    int cell_head(int cell) const { return head[cell]; }
 
     void print();
+
+private:
+    friend class Cell_Lists<Collision_Grid>;
+
+    int &claim_head(int cell) { return head[cell]; }
+    void release_cell(int) {}
 };
+
+// Slot of the Spatial_Hash table: a cell holding units and its first node
+struct Hash_Slot
+{
+    // -1 if the slot is empty
+    int cell;
+    int head;
+};
+
+// Sparse alternative to Collision_Grid for huge maps with few units. Only the
+// cells holding a unit take a slot, in an open addressing table with linear
+// probing, so memory follows the number of units rather than the map area.
+// Cells are cell_size blocks wide. Likewise never touches the heap after init
+class Spatial_Hash : public Cell_Lists<Spatial_Hash>
+{
+public:
+    int cell_size = 1;
+
+    // At least twice as many slots as nodes, a power of two
+    std::vector<Hash_Slot> slot;
+    int slot_bits = 0;
+
+    // Same as Collision_Grid::init, for a map of map_rows by map_cols blocks
+    void init(int map_rows, int map_cols, int cell_size, int node_num);
+
+    int cell_head(int cell) const;
+
+private:
+    friend class Cell_Lists<Spatial_Hash>;
+
+    // Slot holding the cell, or the empty slot where it would go
+    int find_slot(int cell) const;
+
+    int &claim_head(int cell);
+    void release_cell(int cell);
+};
+
+// Box of a unit in the Sweep_List
+struct Sweep_Entry
+{
+    float min_x;
+    float max_x;
+    float min_y;
+    float max_y;
+    int id;
+};
+
+// Sort-and-sweep alternative to Collision_Grid: the boxes of the units in one
+// array kept sorted along x (then by id). Units move a little each tick, so
+// update restores the order with a few steps of insertion sort, and a query
+// is a binary search plus a scan of the boxes overlapping it along x. Unlike
+// the grids it does not degrade when many units share a cell. Same interface
+// as Collision_Grid; put and remove shift the entries after the unit
+class Sweep_List
+{
+public:
+    std::vector<Sweep_Entry> entry;
+
+    // Widest box in the list, so a query knows how far back to start
+    float max_width = 0.0f;
+
+    // Statistics, as in Collision_Grid: entries written
+    int64_t write_num = 0;
+    int64_t saved_write_num = 0;
+
+    // Room for unit_num units, so put never touches the heap
+    void init(int unit_num);
+
+    template<typename Visit>
+    bool query(const Unit &unit, Visit visit) const;
+
+    // by_center is accepted for the same interface; the whole box is stored
+    void put(Unit &unit, bool by_center);
+    void remove(Unit &unit, bool by_center);
+    void update(const Unit &before, Unit &unit);
+
+private:
+    // Position of the entry of the unit with that box
+    int find(const Unit &unit) const;
+};
+
+template<typename Cells>
+template<typename Visit>
+bool Cell_Lists<Cells>::query(const Unit &unit, Visit visit) const
+{
+    // Every cell under the box, which may span more than two cells when it
+    // covers the path of a moving unit
+    int first = get_grid_index(unit.box_min.x, unit.box_min.y);
+    int last = get_grid_index(unit.box_max.x, unit.box_max.y);
+    int row_lo = first / cols, col_lo = first % cols;
+    int row_hi = last / cols, col_hi = last % cols;
+
+    for (int i = row_lo; i <= row_hi; i++) {
+        for (int j = col_lo; j <= col_hi; j++) {
+            for (int n = cells().cell_head(i * cols + j); n >= 0; n = node[n].next) {
+                int id = node[n].id;
+                if (id == unit.id) {
+                    continue;
+                }
+
+                // A member is in every cell from its first one to the box
+                // corner, so it is reported from the first of those under
+                // the query box only
+                int member_first = node[n].first;
+                if (i != std::max(row_lo, member_first / cols) || j != std::max(col_lo, member_first % cols)) {
+                    continue;
+                }
+                if (!visit(id)) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+template<typename Visit>
+bool Sweep_List::query(const Unit &unit, Visit visit) const
+{
+    float start = unit.box_min.x - max_width;
+    auto first = std::lower_bound(entry.begin(), entry.end(), start,
+        [](const Sweep_Entry &e, float x) { return e.min_x < x; });
+
+    for (auto it = first; it != entry.end() && it->min_x <= unit.box_max.x; ++it) {
+        if (it->id != unit.id && it->max_x >= unit.box_min.x &&
+            it->min_y <= unit.box_max.y && it->max_y >= unit.box_min.y && !visit(it->id))
+        {
+            return false;
+        }
+    }
+    return true;
+}
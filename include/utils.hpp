@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 #include <glm/glm.hpp>
@@ -7,3 +9,7 @@
 void load_shader_file(std::string filename, std::string& shader_source);
 
 void read_texture_mapping(std::string filename, std::vector<glm::mat2> &texture_mapping);
+
+// 64-bit FNV-1a hash; pass the previous result as h to hash data in pieces
+const static uint64_t HASH_INIT = 0xcbf29ce484222325ULL;
+uint64_t hash_bytes(const void *data, size_t size, uint64_t h = HASH_INIT);
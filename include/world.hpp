@@ -0,0 +1,279 @@
+#pragma once
+
+#include "overlap.hpp"
+#include "types.hpp"
+#include "rng.hpp"
+#include <string>
+
+// Bullets sweep their whole path every tick, so the rate can be lowered at
+// build time without them passing through walls
+#ifndef TICKS_PER_SECOND
+#define TICKS_PER_SECOND 60
+#endif
+#define FIRE_INTERVAL_TICKS (TICKS_PER_SECOND / 2)
+// Most units a bullet considers hitting in one tick; the nearest ones are kept
+#define BULLET_HIT_MAX_NUM 16
+
+// The simulation always advances by this amount of time per step
+const static float TICK_TIME = 1.0f / TICKS_PER_SECOND;
+
+// Bits of the packed Input
+#define INPUT_UP 0x01
+#define INPUT_DOWN 0x02
+#define INPUT_LEFT 0x04
+#define INPUT_RIGHT 0x08
+#define INPUT_FIRE 0x10
+#define INPUT_BITS 5
+
+// Player commands for a single simulation step
+struct Input
+{
+    bool up = false;
+    bool down = false;
+    bool left = false;
+    bool right = false;
+    bool fire = false;
+
+    // Pack into / unpack from an INPUT_* bitmask
+    unsigned char bits() const;
+    static Input from_bits(unsigned char bits);
+};
+
+// Scripted player that holds random key combinations for a while, like a person
+// would; used to drive headless matches
+class Random_Player
+{
+public:
+    Rng rng;
+    Input input;
+    int hold = 0;
+
+    void seed(uint64_t seed);
+
+    // Input for the next tick
+    Input next();
+};
+
+// Index of the tanks and bullets used to find what they may collide with
+enum class Broadphase
+{
+    // Collision_Grid: one cell per map block
+    grid = 0,
+    // Spatial_Hash: only the cells in use, for huge maps with few units
+    hash = 1,
+    // Sweep_List: sorted along x, for crowds packed in a few cells
+    sweep = 2,
+};
+
+// Name of a broadphase as given on the command line, and back
+const char *broadphase_name(Broadphase broadphase);
+bool parse_broadphase(const std::string &name, Broadphase &broadphase);
+
+// Size of a match
+struct World_Config
+{
+    // Enemy tanks on the field at the same time, and in total
+    int enemy_num = TANK_ENEMY_NUM;
+    int enemy_total = TANK_ENEMY_MAX_NUM;
+
+    // Bullets each tank may have in flight at the same time
+    int bullet_num = 1;
+
+    // Collision index, and the size of the Spatial_Hash cells in blocks
+    Broadphase broadphase = Broadphase::grid;
+    int hash_cell_size = 2;
+};
+
+// Work done by the broadphase of a world
+struct Broadphase_Stats
+{
+    // Cell memberships written, and those saved by incremental updates
+    int64_t write_num;
+    int64_t saved_write_num;
+    // Memory held by the index
+    size_t bytes;
+};
+
+// Something a bullet runs into during a tick that stops it: a block, a tank,
+// another bullet, or the edge of the map (target id -1). Found by the
+// detection pass of the bullets and applied by their resolve pass
+struct Bullet_Contact
+{
+    int bullet;
+    Unit_Handle target;
+    // How far the bullet goes this tick to reach the target; all bullets fly
+    // at the same speed, so this also orders the contacts in time
+    float distance;
+};
+
+// A unit met by a moving bullet, and how far the bullet went to reach it
+struct Bullet_Hit
+{
+    float distance;
+    int id;
+};
+
+// Full simulation state of a world packed into one flat buffer: the tanks,
+// bullets, counters and RNG, then which map blocks still stand and the collision
+// grid. It holds no pointers, so it can be cloned or stored with a plain memcpy;
+// rendering data is not part of it
+struct World_Snapshot
+{
+    std::vector<unsigned char> data;
+};
+
+// Owns the whole game state and advances it without any window or GL context
+class World
+{
+public:
+    Map map;
+    Battle battle;
+    // Only the one chosen by config.broadphase is filled
+    Collision_Grid coll_grid;
+    Spatial_Hash spatial_hash;
+    Sweep_List sweep_list;
+    Rng rng;
+    World_Config config;
+
+    bool is_home_hit = false;
+    // Tank whose bullet destroyed the home, -1 while it stands
+    int home_hit_owner = -1;
+    int64_t tick = 0;
+    // One per tank
+    std::vector<int64_t> last_firing_tick;
+
+    // Bullet contacts found this tick; keeps its capacity from tick to tick
+    std::vector<Bullet_Contact> contacts;
+    // One per bullet slot: how far the bullet got this tick before it was
+    // stopped, infinity while it flies
+    std::vector<float> bullet_stop_distance;
+    // One per tank: how far the first bullet that hit it this tick went,
+    // infinity if none did
+    std::vector<float> tank_hit_distance;
+    // Blocks destroyed this tick, and how far the bullet went
+    std::vector<Bullet_Hit> block_hits;
+
+    // Load the map, place the tanks and fill the collision grid; the seed
+    // fully determines the enemy behaviour. False if the map can't be loaded
+    bool init(std::string map_filename, uint64_t seed, const World_Config &config);
+
+    // Advance the game by one fixed tick using the given player commands
+    void step(const Input &input);
+
+    // True if the home is destroyed or all the enemy tanks are gone
+    bool is_over();
+
+    // True if a bullet the user fires with this input would fly along a
+    // lane holding the home; lets scripted players spare their own home
+    bool is_home_in_line(const Input &input) const;
+
+    // Become a copy of another world, keeping the room init reserves for
+    // stepping; a plain copy would allocate again in the first busy ticks
+    void clone_from(const World &other);
+
+    // Capture or restore the full simulation state; restore leaves the world
+    // untouched and returns false if the snapshot doesn't fit it
+    void save(World_Snapshot &snapshot);
+    bool restore(const World_Snapshot &snapshot);
+
+    // Hash of the full simulation state, to check that two runs stay in sync
+    uint64_t hash();
+
+    // Look up a tank or a bullet by its id (see UNIT_ID_TANK and UNIT_ID_BULLET)
+    Unit *unit(int id);
+    const Unit *unit(int id) const;
+
+    // Handle to the current life of a tank or a bullet, and back; nullptr if
+    // that unit is gone
+    Unit_Handle handle(int id);
+    Unit *unit(Unit_Handle handle);
+
+    // Type of any unit, including map blocks
+    Unit_Type unit_type(int id) const;
+
+    // Call visit(id) once for each tank or bullet overlapping the given unit;
+    // stops and returns false as soon as visit returns false. visit must not
+    // change the grid
+    template<typename Visit>
+    bool for_each_collision(const Unit &unit, Visit visit) const;
+
+    // Ids of the tanks and bullets overlapping the given unit, up to max_num;
+    // returns how many were written
+    int check_collision(Unit &unit, int *ids, int max_num);
+
+    Broadphase_Stats broadphase_stats() const;
+
+private:
+    // Reserve the scratch vectors filled while stepping
+    void reserve_scratch();
+
+    // Bytes in a snapshot of this world with sweep_num units in the Sweep_List
+    size_t snapshot_size(int sweep_num) const;
+
+    // Keep the broadphase in step with the tanks and bullets
+    void broadphase_put(Unit &unit);
+    void broadphase_remove(Unit &unit);
+    void broadphase_update(const Unit &before, Unit &unit);
+
+    bool on_tank_move(int i);
+    bool on_tank_move(int i, Direction direction);
+
+    void on_bullet_firing(int i);
+
+    // What stops the bullet in the given slot this tick further than
+    // min_distance along its path, the nearest contacts only; returns how
+    // many. Reads the world only, so the bullets can be checked in any order,
+    // or at the same time
+    int detect_bullet_contacts(int slot, float min_distance, Bullet_Contact *found) const;
+
+    // True if the target of the contact was taken out by another bullet
+    // before this one got there
+    bool is_contact_stale(const Bullet_Contact &contact) const;
+    void on_bullet_hit(Bullet &bullet, const Bullet_Contact &contact);
+
+    void handle_user_tank(const Input &input);
+    void handle_enemy_tanks();
+    void handle_bullet_moving();
+};
+
+template<typename Visit>
+bool World::for_each_collision(const Unit &unit, Visit visit) const
+{
+    // Gather the neighbours and test them against the unit a batch at a time
+    Box_Batch batch;
+    int ids[OVERLAP_BATCH_MAX];
+    auto flush = [&]() {
+        batch.pad();
+        uint32_t hits = overlap_batch(unit.box_min, unit.box_max, batch);
+        int num = batch.num;
+        batch.num = 0;
+        for (int k = 0; k < num; k++) {
+            if (((hits >> k) & 1) != 0 && !visit(ids[k])) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    auto gather = [&](int id) {
+        const Unit &other = *this->unit(id);
+        ids[batch.num] = id;
+        batch.add(other.box_min, other.box_max);
+        return batch.num < OVERLAP_BATCH_MAX || flush();
+    };
+
+    bool is_done;
+    switch (config.broadphase)
+    {
+    case Broadphase::hash:
+        is_done = spatial_hash.query(unit, gather);
+        break;
+    case Broadphase::sweep:
+        is_done = sweep_list.query(unit, gather);
+        break;
+    default:
+        is_done = coll_grid.query(unit, gather);
+        break;
+    }
+    return is_done && flush();
+}
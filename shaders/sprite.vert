@@ -0,0 +1,39 @@
+#version 330 core
+
+// Instanced path: the unit quad is drawn once per Sprite, placed and textured
+// from the per-instance attributes
+#define TILE_MAX_NUM 16
+
+// Corner of the unit quad, x to the right and y down
+in vec2 corner;
+
+in vec4 rect;
+in float tile;
+in float depth;
+in float direction;
+
+// Atlas rectangle of each Unit_Type: upper left uv, then lower right uv
+uniform vec4 tiles[TILE_MAX_NUM];
+
+out vec2 fTexc;
+
+void main()
+{
+	gl_Position = vec4(mix(rect.xy, rect.zw, bvec2(corner)), depth, 1.0);
+
+	// Corner of the texture landing on this corner: the texture faces up and
+	// is turned clockwise a quarter per direction
+	vec2 st;
+	int d = int(direction);
+	if (d == 0)
+		st = corner;
+	else if (d == 1)
+		st = vec2(corner.y, 1.0 - corner.x);
+	else if (d == 2)
+		st = 1.0 - corner;
+	else
+		st = vec2(1.0 - corner.y, corner.x);
+
+	vec4 uv = tiles[int(tile)];
+	fTexc = mix(uv.xy, uv.zw, bvec2(st));
+}
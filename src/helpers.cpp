@@ -5,7 +5,9 @@
 #include "helpers.hpp"
 
 // System Headers
+#include <algorithm>
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include <fstream>
 
@@ -40,7 +42,23 @@ void VertexBufferObject::bind()
 
 void VertexBufferObject::free()
 {
+	for (int i = 0; i < STREAM_REGION_NUM; i++)
+	{
+		if (fences[i])
+		{
+			glDeleteSync(fences[i]);
+			fences[i] = 0;
+		}
+	}
+	if (mapped)
+	{
+		glBindBuffer(GL_ARRAY_BUFFER, id);
+		glUnmapBuffer(GL_ARRAY_BUFFER);
+		mapped = nullptr;
+	}
 	glDeleteBuffers(1, &id);
+	is_streaming = false;
+	is_persistent = false;
 }
 
 void VertexBufferObject::update(const GLfloat *M, int size, int attr_num)
@@ -61,6 +79,105 @@ void VertexBufferObject::update(const GLint *M, int size, int attr_num)
     check_gl_error();
 }
 
+void VertexBufferObject::init_stream(int max_size, int attr_num)
+{
+	assert(id != 0);
+	is_streaming = true;
+	region_bytes = sizeof(GLfloat) * max_size;
+	// Start on the last region so the first stream() writes at offset 0
+	region = STREAM_REGION_NUM - 1;
+	attrib_num = attr_num;
+
+	glBindBuffer(GL_ARRAY_BUFFER, id);
+	is_persistent = GLAD_GL_VERSION_4_4 || GLAD_GL_ARB_buffer_storage;
+	if (is_persistent)
+	{
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glBufferStorage(GL_ARRAY_BUFFER, region_bytes * STREAM_REGION_NUM, nullptr, flags);
+		mapped = glMapBufferRange(GL_ARRAY_BUFFER, 0, region_bytes * STREAM_REGION_NUM, flags);
+		// Some drivers expose buffer storage but refuse to map it
+		if (!mapped)
+		{
+			std::cerr << "Persistent mapping failed, using glBufferSubData" << std::endl;
+			glDeleteBuffers(1, &id);
+			glGenBuffers(1, &id);
+			glBindBuffer(GL_ARRAY_BUFFER, id);
+			is_persistent = false;
+		}
+	}
+	if (!is_persistent)
+		glBufferData(GL_ARRAY_BUFFER, region_bytes * STREAM_REGION_NUM, nullptr, GL_STREAM_DRAW);
+	check_gl_error();
+}
+
+void VertexBufferObject::next_region()
+{
+	assert(is_streaming);
+	region = (region + 1) % STREAM_REGION_NUM;
+	if (!is_persistent)
+		return;
+
+	// Wait until the draws that read this region two frames ago are done;
+	// with three regions this is almost always already the case
+	GLsync &sync = fences[region];
+	if (sync)
+	{
+		GLenum status = glClientWaitSync(sync, 0, 0);
+		while (status == GL_TIMEOUT_EXPIRED)
+			status = glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+		glDeleteSync(sync);
+		sync = 0;
+	}
+}
+
+void VertexBufferObject::write(const GLfloat *M, int first, int size)
+{
+	assert(is_streaming);
+	GLintptr start = offset() + sizeof(GLfloat) * first;
+	GLsizeiptr bytes = sizeof(GLfloat) * size;
+	assert(sizeof(GLfloat) * first + bytes <= size_t(region_bytes));
+	if (bytes == 0)
+		return;
+
+	if (is_persistent)
+	{
+		memcpy((char*)mapped + start, M, bytes);
+		return;
+	}
+	// The driver renames or queues the write itself
+	glBindBuffer(GL_ARRAY_BUFFER, id);
+	glBufferSubData(GL_ARRAY_BUFFER, start, bytes, M);
+	check_gl_error();
+}
+
+void VertexBufferObject::stream(const GLfloat *M, int size)
+{
+	next_region();
+	write(M, 0, size);
+}
+
+GLintptr VertexBufferObject::offset() const
+{
+	return is_streaming ? region_bytes * region : 0;
+}
+
+void VertexBufferObject::fence()
+{
+	if (!is_persistent)
+		return;
+	if (fences[region])
+		glDeleteSync(fences[region]);
+	fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+void VertexBufferObject::update_range(const GLfloat *M, int first, int size)
+{
+	assert(id != 0 && !is_streaming);
+	glBindBuffer(GL_ARRAY_BUFFER, id);
+	glBufferSubData(GL_ARRAY_BUFFER, sizeof(GLfloat) * first, sizeof(GLfloat) * size, M);
+	check_gl_error();
+}
+
 ElementBufferObject::ElementBufferObject()
 {
 	glGenBuffers(1, &id);
@@ -85,6 +202,51 @@ void ElementBufferObject::free()
 	glDeleteBuffers(1, &id);
 }
 
+// Fill the table of the active uniforms or attributes of a linked program
+static void list_variables(GLuint program, bool is_uniform, std::vector<ProgramVariable> &variables)
+{
+	variables.clear();
+	GLint num = 0, name_max = 0;
+	glGetProgramiv(program, is_uniform ? GL_ACTIVE_UNIFORMS : GL_ACTIVE_ATTRIBUTES, &num);
+	glGetProgramiv(program, is_uniform ? GL_ACTIVE_UNIFORM_MAX_LENGTH : GL_ACTIVE_ATTRIBUTE_MAX_LENGTH, &name_max);
+
+	std::vector<char> buffer(std::max(name_max, 1));
+	for (GLint i = 0; i < num; i++)
+	{
+		GLsizei length = 0;
+		ProgramVariable variable;
+		if (is_uniform)
+			glGetActiveUniform(program, GLuint(i), GLsizei(buffer.size()), &length, &variable.size, &variable.type, buffer.data());
+		else
+			glGetActiveAttrib(program, GLuint(i), GLsizei(buffer.size()), &length, &variable.size, &variable.type, buffer.data());
+		variable.name.assign(buffer.data(), length);
+		variable.location = is_uniform ?
+			glGetUniformLocation(program, variable.name.c_str()) :
+			glGetAttribLocation(program, variable.name.c_str());
+
+		// Built-in inputs such as gl_VertexID, and uniforms in blocks, have no location
+		if (variable.location < 0)
+			continue;
+		// Arrays are reported as "name[0]"
+		size_t bracket = variable.name.size() >= 3 ? variable.name.size() - 3 : std::string::npos;
+		if (bracket != std::string::npos && variable.name.compare(bracket, 3, "[0]") == 0)
+			variable.name.resize(bracket);
+		variables.push_back(variable);
+	}
+	check_gl_error();
+}
+
+// The variable with that name in a table, or nullptr
+static const ProgramVariable *find_variable(const std::vector<ProgramVariable> &variables, const std::string &name)
+{
+	for (const ProgramVariable &variable : variables)
+	{
+		if (variable.name == name)
+			return &variable;
+	}
+	return nullptr;
+}
+
 Program::Program()
 {
 	program_shader = glCreateProgram();
@@ -113,6 +275,9 @@ bool Program::init(const std::string &fragment_data_name)
 		return false;
 	}
 
+	list_variables(program_shader, true, uniforms);
+	list_variables(program_shader, false, attributes);
+
 	check_gl_error();
 	return true;
 }
@@ -139,34 +304,86 @@ void Program::bind()
 
 GLint Program::attrib(const std::string &name) const
 {
-	return glGetAttribLocation(program_shader, name.c_str());
+	return attrib_handle(name).location;
 }
 
 GLint Program::uniform(const std::string &name) const
 {
-	return glGetUniformLocation(program_shader, name.c_str());
+	return uniform_handle(name).location;
+}
+
+AttribHandle Program::attrib_handle(const std::string &name) const
+{
+	AttribHandle handle;
+	const ProgramVariable *variable = find_variable(attributes, name);
+	if (variable)
+	{
+		handle.location = variable->location;
+		handle.type = variable->type;
+	}
+	return handle;
+}
+
+UniformHandle Program::uniform_handle(const std::string &name) const
+{
+	UniformHandle handle;
+	const ProgramVariable *variable = find_variable(uniforms, name);
+	if (variable)
+	{
+		handle.location = variable->location;
+		handle.type = variable->type;
+		handle.size = variable->size;
+	}
+	return handle;
 }
 
 GLint Program::bindVertexAttribArray(const std::string &name, VertexBufferObject& VBO) const
 {
-	GLint id = attrib(name);
-	if (id < 0)
-		return id;
+	AttribHandle handle = attrib_handle(name);
+	bindVertexAttribArray(handle, VBO);
+	return handle.location;
+}
+
+void Program::bindVertexAttribArray(AttribHandle attrib, VertexBufferObject& VBO) const
+{
+	if (!attrib.valid())
+		return;
 	if (VBO.id == 0)
 	{
-		glDisableVertexAttribArray(id);
-		return id;
+		glDisableVertexAttribArray(attrib.location);
+		return;
 	}
 	VBO.bind();
-	glEnableVertexAttribArray(id);
-	glVertexAttribPointer(id, VBO.attrib_num, GL_FLOAT, GL_FALSE, 0, 0);
+	glEnableVertexAttribArray(attrib.location);
+	glVertexAttribPointer(attrib.location, VBO.attrib_num, GL_FLOAT, GL_FALSE, 0, (const void*)VBO.offset());
 	check_gl_error();
+}
 
-	return id;
+GLint Program::bindInstanceAttribArray(const std::string &name, VertexBufferObject& VBO,
+	int size, int stride, int first) const
+{
+	AttribHandle handle = attrib_handle(name);
+	bindInstanceAttribArray(handle, VBO, size, stride, first);
+	return handle.location;
+}
+
+void Program::bindInstanceAttribArray(AttribHandle attrib, VertexBufferObject& VBO,
+	int size, int stride, int first) const
+{
+	if (!attrib.valid())
+		return;
+	VBO.bind();
+	glEnableVertexAttribArray(attrib.location);
+	GLintptr offset = VBO.offset() + sizeof(GLfloat) * first;
+	glVertexAttribPointer(attrib.location, size, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * stride, (const void*)offset);
+	glVertexAttribDivisor(attrib.location, 1);
+	check_gl_error();
 }
 
 void Program::free()
 {
+	uniforms.clear();
+	attributes.clear();
 	if (program_shader)
 	{
 		glDeleteProgram(program_shader);
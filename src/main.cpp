@@ -1,246 +1,57 @@
 // Local Headers
 #include "helpers.hpp"
+#include "replay.hpp"
+#include "sprite_batch.hpp"
 #include "types.hpp"
 #include "utils.hpp"
+#include "world.hpp"
 
 // System Headers
 #include <GLFW/glfw3.h>
 
 // Standard Headers 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <ctime>
 #include <iostream>
 
 GLFWwindow* mWindow;
-Map map;
-Battle battle;
-Collision_Grid coll_grid;
+World world;
 
 VertexArrayObject vao_map;
 VertexArrayObject vao_battle;
+
+// Geometry shader path: one line per unit, turned into a quad
 VertexBufferObject vbo_map_vert;
+VertexBufferObject vbo_map_texc;
 VertexBufferObject vbo_battle_vert;
+VertexBufferObject vbo_battle_texc;
+AttribHandle attrib_pos;
 
-double prev_time, cur_time;
-
-bool is_home_hit = false;
-
-template<typename T, int size>
-int getArrayLength(T(&)[size]) { return size; }
-
-bool on_tank_move(int i)
-{
-    //if (map.has_reached_edge(battle.tank[i])) {
-    //    return false;
-    //}
-
-    float step = float(cur_time - prev_time) * TANK_MOVE_STEP;
-    Tank dummy = battle.tank[i];
-    dummy.move(step);
-
-    if (dummy.upleft == battle.tank[i].upleft && dummy.downright == battle.tank[i].downright) {
-        return false;
-    }
+// Instanced path: everything in sight in one draw
+Sprite_Batch sprite_batch;
 
-    // Collision check
-    std::vector<Unit*> coll_units = coll_grid.check_collision(dummy);
-    if (coll_units.size() > 0) {
-        for (Unit* unit : coll_units) {
-            switch (unit->type) {
-            case Unit_Type::brick:
-            case Unit_Type::concrete:
-            case Unit_Type::sea:
-            case Unit_Type::home:
-            case Unit_Type::tank_enemy:
-            case Unit_Type::tank_user:
-                return false;
-            }
-        }
-    }
-    
-    coll_grid.remove(battle.tank[i], false);
-    battle.tank[i].move(step);
-    coll_grid.put(battle.tank[i], false);
-
-    return true;
-}
-
-bool on_tank_move(int i, Direction direction)
-{
-    if (battle.tank[i].change_direction(direction) == false) {
-        return on_tank_move(i);
-    }
+// Longest frame time fed to the simulation, so a stall can't trigger a burst of ticks
+const static double MAX_FRAME_TIME = 0.25;
 
-    return true;
-}
-
-void on_bullet_firing(int i)
-{
-    static double last_firing_time[TANK_NUM] = { 0.0f };
-
-    // Each tank can only fire one bullet at a time, and can't fire too fast
-    if (!battle.bullet[i].is_visible && cur_time - last_firing_time[i] > 0.5) {
-        battle.bullet[i].init(battle.tank[i]);
-        coll_grid.put(battle.bullet[i], false);
-
-        last_firing_time[i] = cur_time;
-    }
-}
-
-void handle_bullet_moving()
-{
-    for (int i = 0; i < TANK_NUM; i++) {
-        if (battle.bullet[i].is_visible) {
-            Bullet &bullet = battle.bullet[i];
-            coll_grid.remove(bullet, false);
-
-            if (map.has_reached_edge(bullet)) {
-                bullet.is_visible = false;
-                continue;
-            }
-
-            battle.bullet[i].move(float(cur_time - prev_time) * BULLET_MOVE_STEP);
-
-            // Collision check
-            std::vector<Unit*> coll_units = coll_grid.check_collision(bullet);
-            if (coll_units.size() > 0) {
-                for (Unit* unit : coll_units) {
-                    switch (unit->type)
-                    {
-                    case Unit_Type::brick:
-                    case Unit_Type::bullet:
-                        unit->is_visible = false;
-                        coll_grid.remove(*unit, true);
-                        bullet.is_visible = false;
-                        break;
-                    case Unit_Type::concrete:
-                        bullet.is_visible = false;
-                        break;
-                    case Unit_Type::tank_enemy:
-                        if (bullet.owner_type == Unit_Type::tank_user) {
-                            unit->is_visible = false;
-                            coll_grid.remove(*unit, false);
-
-                            battle.enemy_num -= 1;
-                            battle.enemy_left -= 1;
-                            bullet.is_visible = false;
-                        }
-                        break;
-                    case Unit_Type::tank_user:
-                        if (bullet.owner_type == Unit_Type::tank_enemy) {
-                            // The user is hit; reinitialized to the original position
-                            coll_grid.remove(*unit, false);
-                            battle.tank[0].init(Unit_Type::tank_user, MAP_ROWS - 1, 3);
-                            bullet.is_visible = false;
-                        }
-                        break;
-                    case Unit_Type::home:
-                        // The home is hit; game over
-                        is_home_hit = true;
-                        bullet.is_visible = false;
-                        break;
-                    }
-                }
-            }
-
-            if (bullet.is_visible) {
-                coll_grid.put(bullet, false);
-            }
-        }
-    }
-}
+double prev_time, cur_time;
+double tick_accumulator = 0.0;
 
-void handle_enemy_tanks()
+Input handle_keyboard()
 {
-    for (int i = 1; i < TANK_NUM; i++) {
-        Tank &tank = battle.tank[i];
-        if (tank.is_visible) {
-            // Switch a direction if can't move
-            if (on_tank_move(i) == false) {
-                int r = rand() % 100;
-                if (r < 50 && tank.direction != Direction::down) {
-                    tank.change_direction(Direction::down);
-                }
-                else if (r < 70 && tank.direction != Direction::left) {
-                    tank.change_direction(Direction::left);
-                }
-                else if (r < 90 && tank.direction != Direction::right) {
-                    tank.change_direction(Direction::right);
-                }
-                else if (tank.direction != Direction::up) {
-                    tank.change_direction(Direction::up);
-                }
-                else {
-                    tank.change_direction(Direction::down);
-                }
-            }
-
-            // Fire a bullet
-            if (rand() % 1024 < 10) {
-                on_bullet_firing(i);
-            }
-        } else if (battle.enemy_num < TANK_ENEMY_NUM && battle.enemy_num < battle.enemy_left) {
-            // Make a new enemy
-            int pos = rand() % 3;
-            Tank dummy = tank;
-            for (int i = 0; i < 3; i++) {
-                switch ((pos + i) % 3) {
-                case 0: dummy.init(Unit_Type::tank_enemy, 0, 0); break;
-                case 1: dummy.init(Unit_Type::tank_enemy, 0, MAP_COLS / 2); break;
-                case 2: dummy.init(Unit_Type::tank_enemy, 0, MAP_COLS - 1); break;
-                }
-                dummy.change_direction(Direction::down);
-
-                // Check if there is a tank on the reborn place
-                std::vector<Unit*> coll_units = coll_grid.check_collision(dummy);
-                bool check_failed = false;
-                for (Unit* unit : coll_units) {
-                    switch (unit->type) {
-                    case Unit_Type::tank_enemy:
-                    case Unit_Type::tank_user:
-                        check_failed = true;
-                        break;
-                    }
-
-                    if (check_failed) {
-                        break;
-                    }
-                }
-
-                if (check_failed) {
-                    continue;
-                }
-                else {
-                    tank = dummy;
-                    coll_grid.put(tank, true);
-                    battle.enemy_num += 1;
-                    break;
-                }
-            }
-        }
-    }
-}
+    Input input;
 
-void handle_keyboard()
-{
     // Handle user tank movement
-    if (glfwGetKey(mWindow, GLFW_KEY_UP) == GLFW_PRESS) {
-        on_tank_move(0, Direction::up);
-    }
-    if (glfwGetKey(mWindow, GLFW_KEY_DOWN) == GLFW_PRESS) {
-        on_tank_move(0, Direction::down);
-    }
-    if (glfwGetKey(mWindow, GLFW_KEY_LEFT) == GLFW_PRESS) {
-        on_tank_move(0, Direction::left);
-    }
-    if (glfwGetKey(mWindow, GLFW_KEY_RIGHT) == GLFW_PRESS) {
-        on_tank_move(0, Direction::right);
-    }
+    input.up = glfwGetKey(mWindow, GLFW_KEY_UP) == GLFW_PRESS;
+    input.down = glfwGetKey(mWindow, GLFW_KEY_DOWN) == GLFW_PRESS;
+    input.left = glfwGetKey(mWindow, GLFW_KEY_LEFT) == GLFW_PRESS;
+    input.right = glfwGetKey(mWindow, GLFW_KEY_RIGHT) == GLFW_PRESS;
 
     // Handle firing the bullet
-    if (glfwGetKey(mWindow, GLFW_KEY_SPACE) == GLFW_PRESS) {
-        on_bullet_firing(0);
-    }
+    input.fire = glfwGetKey(mWindow, GLFW_KEY_SPACE) == GLFW_PRESS;
+
+    return input;
 }
 
 int init_window()
@@ -274,124 +85,224 @@ int init_window()
 	return EXIT_SUCCESS;
 }
 
-int main(void)
+void init_line_path(Program &program, std::vector<glm::mat2> &texture_mapping)
 {
-    if (init_window() != EXIT_SUCCESS) {
-		return EXIT_FAILURE;
-	}
-
-    printf("OpenGL %s\n", (const char*)glGetString(GL_VERSION));
-    printf("GLSL %s\n", (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION));
-
-	std::string unit_vert, unit_frag, unit_geom;
-	load_shader_file("../shaders/unit.vert", unit_vert);
-	load_shader_file("../shaders/unit.frag", unit_frag);
-	load_shader_file("../shaders/unit.geom", unit_geom);
-
-	Program program;
-	program.attach(GL_VERTEX_SHADER, unit_vert);
-	program.attach(GL_FRAGMENT_SHADER, unit_frag);
-	program.attach(GL_GEOMETRY_SHADER, unit_geom);
-	program.init("outColor");
-	program.bind();
-
-    // Initialize texture
-    std::vector<glm::mat2> texture_mapping;
-    read_texture_mapping("../res/map_texture_mapping.txt", texture_mapping);
-
-    Texture texture_map;
-    texture_map.load(GL_TEXTURE0, "../res/map.png");
-    glUniform1i(program.uniform("texMap"), 0);
-
-    // Setting map
-    map.read_map("../res/map.txt");
+    Map &map = world.map;
     map.init_texc(texture_mapping);
+    map.refresh_data();
 
     vao_map.init();
 	vao_map.bind();
 
+    // Only the blocks destroyed since the last frame are uploaded again
     vbo_map_vert.init();
-    vbo_map_vert.update(map.vert, getArrayLength(map.vert), 3);
+    vbo_map_vert.update(map.vert.data(), int(map.vert.size()), 3);
     program.bindVertexAttribArray("pos", vbo_map_vert);
 
-	VertexBufferObject vbo_map_texc;
     vbo_map_texc.init();
-	vbo_map_texc.update(map.texc, getArrayLength(map.texc), 2);
+	vbo_map_texc.update(map.texc.data(), int(map.texc.size()), 2);
     program.bindVertexAttribArray("texc", vbo_map_texc);
 
     // Setting tanks
-    battle.init();
+    Battle &battle = world.battle;
     battle.init_texc(texture_mapping);
 
     vao_battle.init();
     vao_battle.bind();
 
+    // The battle moves every frame, so its positions are streamed
     vbo_battle_vert.init();
-    vbo_battle_vert.update(battle.vert, getArrayLength(battle.vert), 3);
-    program.bindVertexAttribArray("pos", vbo_battle_vert);
+    vbo_battle_vert.init_stream(int(battle.vert.size()), 3);
+    attrib_pos = program.attrib_handle("pos");
 
-    VertexBufferObject vbo_battle_texc;
     vbo_battle_texc.init();
-    vbo_battle_texc.update(battle.texc, getArrayLength(battle.texc), 2);
+    vbo_battle_texc.update(battle.texc.data(), int(battle.texc.size()), 2);
     program.bindVertexAttribArray("texc", vbo_battle_texc);
+}
 
-    glEnable(GL_DEPTH_TEST);
+void draw_line_path(Program &program, float alpha)
+{
+    Map &map = world.map;
+    Battle &battle = world.battle;
 
-    // Setting collision grid
-    // Map units
-    for (int i = 0; i < MAP_ROWS; i++) {
-        for (int j = 0; j < MAP_COLS; j++) {
-            if (map.block[i][j].type == Unit_Type::brick ||
-                map.block[i][j].type == Unit_Type::concrete ||
-                map.block[i][j].type == Unit_Type::sea ||
-                map.block[i][j].type == Unit_Type::home)
-            {
-                coll_grid.put(map.block[i][j], true);
-            }
-        }
+	// Draw the map
+    map.refresh_data();
+    for (const Block_Range &range : map.block_changed) {
+        vbo_map_vert.update_range(map.vert.data() + range.first * 6, range.first * 6, range.num * 6);
     }
-    // Tanks
-    for (int i = 0; i < TANK_NUM; i++) {
-        if (battle.tank[i].is_visible) {
-            coll_grid.put(battle.tank[i], true);
+    vao_map.bind();
+	glDrawArrays(GL_LINES, 0, int(map.vert.size()) / 3);
+
+    // Draw the tanks
+    battle.refresh_data(map, alpha);
+    vao_battle.bind();
+    vbo_battle_vert.stream(battle.vert.data(), int(battle.vert.size()));
+    program.bindVertexAttribArray(attrib_pos, vbo_battle_vert);
+    glDrawArrays(GL_LINES, 0, int(battle.vert.size()) / 3);
+    vbo_battle_vert.fence();
+}
+
+int main(int argc, char *argv[])
+{
+    // Usage: Tank2017 [--record FILE] [--map FILE] [--enemies N] [--bullets N]
+    //                 [--instanced] [--bench-frames N]
+    std::string record_file;
+    std::string map_file = "../res/map.txt";
+    World_Config config;
+    bool use_geometry_shader = true;
+    int bench_frames = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--record" && i + 1 < argc) {
+            record_file = argv[++i];
+        }
+        else if (arg == "--map" && i + 1 < argc) {
+            map_file = argv[++i];
+        }
+        else if (arg == "--enemies" && i + 1 < argc) {
+            config.enemy_num = std::max(1, atoi(argv[++i]));
+            config.enemy_total = std::max(config.enemy_total, config.enemy_num);
         }
+        else if (arg == "--bullets" && i + 1 < argc) {
+            config.bullet_num = std::max(1, atoi(argv[++i]));
+        }
+        else if (arg == "--instanced") {
+            use_geometry_shader = false;
+        }
+        else if (arg == "--bench-frames" && i + 1 < argc) {
+            bench_frames = atoi(argv[++i]);
+        }
+    }
+
+    if (init_window() != EXIT_SUCCESS) {
+		return EXIT_FAILURE;
+	}
+
+    printf("OpenGL %s\n", (const char*)glGetString(GL_VERSION));
+    printf("GLSL %s\n", (const char*)glGetString(GL_SHADING_LANGUAGE_VERSION));
+
+	std::string unit_vert, unit_frag, unit_geom, sprite_vert;
+	load_shader_file("../shaders/unit.vert", unit_vert);
+	load_shader_file("../shaders/unit.frag", unit_frag);
+	load_shader_file("../shaders/unit.geom", unit_geom);
+	load_shader_file("../shaders/sprite.vert", sprite_vert);
+
+    // The geometry shader by default, as it draws a large map faster on a
+    // software renderer; instanced quads on request, unless they fail to build
+    Program sprite_program;
+    if (!use_geometry_shader) {
+        sprite_program.attach(GL_VERTEX_SHADER, sprite_vert);
+        sprite_program.attach(GL_FRAGMENT_SHADER, unit_frag);
+        use_geometry_shader = !sprite_program.init("outColor");
+    }
+
+	Program line_program;
+    if (use_geometry_shader) {
+        line_program.attach(GL_VERTEX_SHADER, unit_vert);
+        line_program.attach(GL_FRAGMENT_SHADER, unit_frag);
+        line_program.attach(GL_GEOMETRY_SHADER, unit_geom);
+        line_program.init("outColor");
+    }
+    Program &program = use_geometry_shader ? line_program : sprite_program;
+    program.bind();
+    printf("Rendering with %s\n", use_geometry_shader ? "the geometry shader" : "instancing");
+
+    // Initialize texture
+    std::vector<glm::mat2> texture_mapping;
+    read_texture_mapping("../res/map_texture_mapping.txt", texture_mapping);
+
+    Texture texture_map;
+    texture_map.load(GL_TEXTURE0, "../res/map.png");
+    glUniform1i(program.uniform("texMap"), 0);
+
+    // Setting the game state
+    uint64_t seed = uint64_t(time(nullptr));
+    printf("Seed %llu\n", (unsigned long long)seed);
+    if (!world.init(map_file, seed, config)) {
+        glfwTerminate();
+        return EXIT_FAILURE;
+    }
+
+    Replay replay;
+    replay.start(world, seed, TICKS_PER_SECOND);
+
+    if (use_geometry_shader) {
+        init_line_path(program, texture_mapping);
+    }
+    else {
+        sprite_batch.init(program, texture_mapping);
+    }
+
+    glEnable(GL_DEPTH_TEST);
+
+    // Frames are not synced to the screen while benchmarking
+    if (bench_frames > 0) {
+        glfwSwapInterval(0);
     }
+    int frame = 0;
+    int64_t sprite_num = 0;
+    double bench_start = glfwGetTime();
 
     // Timer
+    world.battle.save_poses();
     prev_time = glfwGetTime();
 
 	// Rendering Loop
-	while (!glfwWindowShouldClose(mWindow) && !is_home_hit) {
+	while (!glfwWindowShouldClose(mWindow) && !world.is_home_hit) {
 		// Background Fill Color
 		glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
         cur_time = glfwGetTime();
-
-        // Main game logic
-        handle_keyboard();
-        handle_enemy_tanks();
-        handle_bullet_moving();
-
+        tick_accumulator += std::min(cur_time - prev_time, MAX_FRAME_TIME);
         prev_time = cur_time;
 
-		// Draw the map
-        map.refresh_data();
-        vao_map.bind();
-        vbo_map_vert.update(map.vert, getArrayLength(map.vert), 3);
-		glDrawArrays(GL_LINES, 0, getArrayLength(map.vert) / 2);
+        // Main game logic, advanced in fixed ticks
+        Input input = handle_keyboard();
+        while (tick_accumulator >= TICK_TIME) {
+            world.battle.save_poses();
+            world.step(input);
+            if (!record_file.empty()) {
+                replay.record(input, world);
+            }
+            tick_accumulator -= TICK_TIME;
+        }
 
-        // Draw the tanks
-        battle.refresh_data();
-        vao_battle.bind();
-        vbo_battle_vert.update(battle.vert, getArrayLength(battle.vert), 3);
-        glDrawArrays(GL_LINES, 0, getArrayLength(battle.vert) / 2);
+        float alpha = float(tick_accumulator / TICK_TIME);
+        if (use_geometry_shader) {
+            draw_line_path(program, alpha);
+        }
+        else {
+            sprite_batch.draw(program, world.map, world.battle, alpha);
+            sprite_num += sprite_batch.num;
+        }
 
 		// Flip Buffers and Draw
 		glfwSwapBuffers(mWindow);
 		glfwPollEvents();
+
+        if (bench_frames > 0 && ++frame == bench_frames) {
+            glFinish();
+            double elapsed = glfwGetTime() - bench_start;
+            printf("%d frames, %.3f ms per frame", frame, elapsed * 1000.0 / frame);
+            if (!use_geometry_shader) {
+                printf(", %lld sprites per frame", (long long)(sprite_num / frame));
+            }
+            printf("\n");
+            break;
+        }
 	}
 
+    if (use_geometry_shader) {
+        vbo_battle_vert.free();
+    }
+    else {
+        sprite_batch.free();
+    }
 	glfwTerminate();
+
+    if (!record_file.empty()) {
+        replay.save(record_file);
+    }
 	return EXIT_SUCCESS;
 }
@@ -0,0 +1,52 @@
+#include "overlap.hpp"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define OVERLAP_AVX
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define OVERLAP_SSE2
+#endif
+
+uint32_t overlap_batch(glm::vec2 box_min, glm::vec2 box_max, const Box_Batch &batch)
+{
+    uint32_t hits = 0;
+
+#if defined(OVERLAP_AVX)
+    __m256 min_x = _mm256_set1_ps(box_min.x);
+    __m256 min_y = _mm256_set1_ps(box_min.y);
+    __m256 max_x = _mm256_set1_ps(box_max.x);
+    __m256 max_y = _mm256_set1_ps(box_max.y);
+    for (int k = 0; k < batch.num; k += 8) {
+        __m256 overlap = _mm256_and_ps(
+            _mm256_and_ps(_mm256_cmp_ps(max_x, _mm256_load_ps(batch.min_x + k), _CMP_GT_OQ),
+                _mm256_cmp_ps(_mm256_load_ps(batch.max_x + k), min_x, _CMP_GT_OQ)),
+            _mm256_and_ps(_mm256_cmp_ps(max_y, _mm256_load_ps(batch.min_y + k), _CMP_GT_OQ),
+                _mm256_cmp_ps(_mm256_load_ps(batch.max_y + k), min_y, _CMP_GT_OQ)));
+        hits |= uint32_t(_mm256_movemask_ps(overlap)) << k;
+    }
+#elif defined(OVERLAP_SSE2)
+    __m128 min_x = _mm_set1_ps(box_min.x);
+    __m128 min_y = _mm_set1_ps(box_min.y);
+    __m128 max_x = _mm_set1_ps(box_max.x);
+    __m128 max_y = _mm_set1_ps(box_max.y);
+    for (int k = 0; k < batch.num; k += 4) {
+        __m128 overlap = _mm_and_ps(
+            _mm_and_ps(_mm_cmpgt_ps(max_x, _mm_load_ps(batch.min_x + k)),
+                _mm_cmpgt_ps(_mm_load_ps(batch.max_x + k), min_x)),
+            _mm_and_ps(_mm_cmpgt_ps(max_y, _mm_load_ps(batch.min_y + k)),
+                _mm_cmpgt_ps(_mm_load_ps(batch.max_y + k), min_y)));
+        hits |= uint32_t(_mm_movemask_ps(overlap)) << k;
+    }
+#else
+    for (int k = 0; k < batch.num; k++) {
+        if (box_max.x > batch.min_x[k] && batch.max_x[k] > box_min.x &&
+            box_max.y > batch.min_y[k] && batch.max_y[k] > box_min.y)
+        {
+            hits |= uint32_t(1) << k;
+        }
+    }
+#endif
+
+    return hits;
+}
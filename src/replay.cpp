@@ -0,0 +1,203 @@
+#include "replay.hpp"
+#include <cstdio>
+#include <fstream>
+
+#define REPLAY_VERSION 10
+
+static void write_varint(std::vector<unsigned char> &out, uint64_t value)
+{
+    while (value >= 0x80) {
+        out.push_back(static_cast<unsigned char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<unsigned char>(value));
+}
+
+static void write_fixed(std::vector<unsigned char> &out, uint64_t value, int bytes)
+{
+    for (int i = 0; i < bytes; i++) {
+        out.push_back(static_cast<unsigned char>(value >> (8 * i)));
+    }
+}
+
+static bool read_varint(const std::vector<unsigned char> &in, size_t &pos, uint64_t &value)
+{
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (pos >= in.size()) {
+            return false;
+        }
+        unsigned char byte = in[pos++];
+        value |= uint64_t(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_fixed(const std::vector<unsigned char> &in, size_t &pos, uint64_t &value, int bytes)
+{
+    if (pos + bytes > in.size()) {
+        return false;
+    }
+    value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value |= uint64_t(in[pos++]) << (8 * i);
+    }
+    return true;
+}
+
+void Replay::start(World &world, uint64_t seed, int hash_interval)
+{
+    this->seed = seed;
+    this->map_hash = world.map.hash();
+    this->config = world.config;
+    this->ticks_per_second = TICKS_PER_SECOND;
+    this->hash_interval = hash_interval;
+    inputs.clear();
+    hashes.clear();
+}
+
+void Replay::record(const Input &input, World &world)
+{
+    inputs.push_back(input.bits());
+    if (inputs.size() % size_t(hash_interval) == 0) {
+        hashes.push_back(uint32_t(world.hash()));
+    }
+}
+
+bool Replay::save(std::string filename)
+{
+    std::vector<unsigned char> out = { 'T', 'N', 'K', 'R', REPLAY_VERSION };
+    write_varint(out, seed);
+    write_fixed(out, map_hash, 8);
+    write_varint(out, ticks_per_second);
+    write_varint(out, config.enemy_num);
+    write_varint(out, config.enemy_total);
+    write_varint(out, config.bullet_num);
+    write_varint(out, static_cast<uint64_t>(config.broadphase));
+    write_varint(out, config.hash_cell_size);
+    write_varint(out, hash_interval);
+    write_varint(out, inputs.size());
+
+    // Run-length encode the inputs; the player holds the same keys for many ticks
+    std::vector<unsigned char> runs;
+    uint64_t run_num = 0;
+    for (size_t i = 0; i < inputs.size(); ) {
+        size_t j = i + 1;
+        while (j < inputs.size() && inputs[j] == inputs[i]) {
+            j++;
+        }
+        write_varint(runs, (uint64_t(j - i) << INPUT_BITS) | inputs[i]);
+        run_num++;
+        i = j;
+    }
+    write_varint(out, run_num);
+    out.insert(out.end(), runs.begin(), runs.end());
+
+    write_varint(out, hashes.size());
+    for (uint32_t hash : hashes) {
+        write_fixed(out, hash, 4);
+    }
+
+    std::ofstream fout(filename, std::ofstream::binary);
+    if (!fout.is_open()) {
+        fprintf(stderr, "Failed to write replay %s\n", filename.c_str());
+        return false;
+    }
+    fout.write(reinterpret_cast<const char*>(out.data()), out.size());
+    return fout.good();
+}
+
+bool Replay::load(std::string filename)
+{
+    std::ifstream fin(filename, std::ifstream::binary);
+    if (!fin.is_open()) {
+        fprintf(stderr, "Failed to open replay %s\n", filename.c_str());
+        return false;
+    }
+    std::vector<unsigned char> in((std::istreambuf_iterator<char>(fin)),
+        std::istreambuf_iterator<char>());
+
+    size_t pos = 5;
+    if (in.size() < pos || in[0] != 'T' || in[1] != 'N' || in[2] != 'K' || in[3] != 'R' ||
+        in[4] != REPLAY_VERSION)
+    {
+        fprintf(stderr, "%s is not a replay file\n", filename.c_str());
+        return false;
+    }
+
+    uint64_t tick_rate, enemy_num, enemy_total, bullet_num, broadphase, hash_cell_size, interval, tick_num, run_num, hash_num;
+    bool ok = read_varint(in, pos, seed) &&
+        read_fixed(in, pos, map_hash, 8) &&
+        read_varint(in, pos, tick_rate) &&
+        read_varint(in, pos, enemy_num) &&
+        read_varint(in, pos, enemy_total) &&
+        read_varint(in, pos, bullet_num) &&
+        read_varint(in, pos, broadphase) &&
+        read_varint(in, pos, hash_cell_size) &&
+        read_varint(in, pos, interval) &&
+        read_varint(in, pos, tick_num) &&
+        read_varint(in, pos, run_num);
+    if (!ok || interval == 0 || enemy_num == 0 || enemy_num > UNIT_ID_INDEX_MASK ||
+        enemy_total == 0 || enemy_total > INT32_MAX ||
+        bullet_num == 0 || bullet_num * (enemy_num + TANK_USER_NUM) > UNIT_ID_INDEX_MASK ||
+        broadphase > uint64_t(Broadphase::sweep) || hash_cell_size == 0 || hash_cell_size > MAP_MAX_SIZE)
+    {
+        fprintf(stderr, "Corrupted replay header in %s\n", filename.c_str());
+        return false;
+    }
+    if (tick_rate != TICKS_PER_SECOND) {
+        fprintf(stderr, "%s was recorded at %llu ticks per second, this build runs at %d\n",
+            filename.c_str(), (unsigned long long)tick_rate, TICKS_PER_SECOND);
+        return false;
+    }
+    ticks_per_second = int(tick_rate);
+    config.enemy_num = int(enemy_num);
+    config.enemy_total = int(enemy_total);
+    config.bullet_num = int(bullet_num);
+    config.broadphase = static_cast<Broadphase>(broadphase);
+    config.hash_cell_size = int(hash_cell_size);
+    hash_interval = int(interval);
+
+    inputs.clear();
+    for (uint64_t i = 0; i < run_num; i++) {
+        uint64_t run;
+        if (!read_varint(in, pos, run) || inputs.size() + (run >> INPUT_BITS) > tick_num) {
+            fprintf(stderr, "Corrupted replay inputs in %s\n", filename.c_str());
+            return false;
+        }
+        inputs.insert(inputs.end(), size_t(run >> INPUT_BITS),
+            static_cast<unsigned char>(run & ((1 << INPUT_BITS) - 1)));
+    }
+
+    hashes.clear();
+    if (inputs.size() != tick_num || !read_varint(in, pos, hash_num)) {
+        fprintf(stderr, "Corrupted replay inputs in %s\n", filename.c_str());
+        return false;
+    }
+    for (uint64_t i = 0; i < hash_num; i++) {
+        uint64_t hash;
+        if (!read_fixed(in, pos, hash, 4)) {
+            fprintf(stderr, "Corrupted replay hashes in %s\n", filename.c_str());
+            return false;
+        }
+        hashes.push_back(uint32_t(hash));
+    }
+
+    return true;
+}
+
+bool Replay::expected_hash(int64_t ticks, uint32_t &hash)
+{
+    if (ticks <= 0 || ticks % hash_interval != 0) {
+        return false;
+    }
+    size_t idx = size_t(ticks / hash_interval) - 1;
+    if (idx >= hashes.size()) {
+        return false;
+    }
+    hash = hashes[idx];
+    return true;
+}
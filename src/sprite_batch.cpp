@@ -0,0 +1,130 @@
+#include "sprite_batch.hpp"
+#include <algorithm>
+#include <cassert>
+
+void Sprite_Batch::init(Program &program, std::vector<glm::mat2> &texture_mapping)
+{
+    // Atlas rectangle of each unit type
+    std::vector<GLfloat> tiles;
+    for (const glm::mat2 &uv : texture_mapping) {
+        tiles.insert(tiles.end(), { uv[0].x, uv[0].y, uv[1].x, uv[1].y });
+    }
+    UniformHandle uniform_tiles = program.uniform_handle("tiles");
+    assert(int(texture_mapping.size()) <= uniform_tiles.size);
+    glUniform4fv(uniform_tiles.location, int(texture_mapping.size()), tiles.data());
+
+    attrib_rect = program.attrib_handle("rect");
+    attrib_tile = program.attrib_handle("tile");
+    attrib_depth = program.attrib_handle("depth");
+    attrib_direction = program.attrib_handle("direction");
+
+    vao.init();
+    vao.bind();
+
+    // Corners of the unit quad, as a triangle strip
+    const GLfloat quad[] = { 0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f };
+    vbo_quad.init();
+    vbo_quad.update(quad, 8, 2);
+    program.bindVertexAttribArray("corner", vbo_quad);
+
+    vbo_sprite.init();
+    reserve(SPRITE_BATCH_MIN_NUM);
+}
+
+void Sprite_Batch::update_map(Map &map)
+{
+    map.refresh_sprites();
+    if (map.block_changed.empty()) {
+        return;
+    }
+    map_version += 1;
+
+    int block_num = map.rows * map.cols;
+    if (int(map_pos.size()) != block_num || map.block_changed[0].num == block_num) {
+        // Loaded or restored: list all the visible blocks again
+        map_sprite.clear();
+        map_block.clear();
+        map_pos.assign(block_num, -1);
+        for (int id = 0; id < block_num; id++) {
+            if (map.block_visible[id]) {
+                map_pos[id] = int(map_sprite.size());
+                map_sprite.push_back(map.sprite[id]);
+                map_block.push_back(id);
+            }
+        }
+        return;
+    }
+
+    for (const Block_Range &range : map.block_changed) {
+        for (int id = range.first; id < range.first + range.num; id++) {
+            int pos = map_pos[id];
+            if (pos >= 0 && !map.block_visible[id]) {
+                // Blocks don't overlap, so the order of the list doesn't
+                // matter: the last one takes the place of the hidden one
+                int last = map_block.back();
+                map_sprite[pos] = map_sprite.back();
+                map_block[pos] = last;
+                map_pos[last] = pos;
+                map_sprite.pop_back();
+                map_block.pop_back();
+                map_pos[id] = -1;
+            }
+            else if (pos >= 0) {
+                map_sprite[pos] = map.sprite[id];
+            }
+            else if (map.block_visible[id]) {
+                map_pos[id] = int(map_sprite.size());
+                map_sprite.push_back(map.sprite[id]);
+                map_block.push_back(id);
+            }
+        }
+    }
+}
+
+void Sprite_Batch::reserve(int num)
+{
+    if (num <= capacity) {
+        return;
+    }
+    capacity = std::max(num, capacity * 2);
+
+    // The GPU keeps the old storage alive until the draws reading it are done
+    if (vbo_sprite.is_streaming) {
+        vbo_sprite.free();
+        vbo_sprite.init();
+    }
+    vbo_sprite.init_stream(capacity * SPRITE_FLOATS, SPRITE_FLOATS);
+    std::fill(region_version, region_version + STREAM_REGION_NUM, 0);
+}
+
+void Sprite_Batch::draw(Program &program, Map &map, Battle &battle, float alpha)
+{
+    update_map(map);
+    int battle_num = battle.refresh_sprites(map, alpha);
+    int map_num = int(map_sprite.size());
+    num = map_num + battle_num;
+    reserve(num);
+
+    vbo_sprite.next_region();
+    if (region_version[vbo_sprite.region] != map_version) {
+        vbo_sprite.write((const GLfloat*)map_sprite.data(), 0, map_num * SPRITE_FLOATS);
+        region_version[vbo_sprite.region] = map_version;
+    }
+    vbo_sprite.write((const GLfloat*)battle.sprite.data(), map_num * SPRITE_FLOATS, battle_num * SPRITE_FLOATS);
+
+    // The region moves every frame, and the attributes with it
+    vao.bind();
+    program.bindInstanceAttribArray(attrib_rect, vbo_sprite, 4, SPRITE_FLOATS, 0);
+    program.bindInstanceAttribArray(attrib_tile, vbo_sprite, 1, SPRITE_FLOATS, 4);
+    program.bindInstanceAttribArray(attrib_depth, vbo_sprite, 1, SPRITE_FLOATS, 5);
+    program.bindInstanceAttribArray(attrib_direction, vbo_sprite, 1, SPRITE_FLOATS, 6);
+    glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, num);
+    vbo_sprite.fence();
+}
+
+void Sprite_Batch::free()
+{
+    vbo_sprite.free();
+    vbo_quad.free();
+    vao.free();
+}
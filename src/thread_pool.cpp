@@ -0,0 +1,83 @@
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <thread>
+
+Work_Stealing_Pool::Work_Stealing_Pool(int thread_num)
+{
+    if (thread_num <= 0) {
+        thread_num = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+    this->thread_num = thread_num;
+}
+
+void Work_Stealing_Pool::run(int job_num, const std::function<void(int, int)> &job)
+{
+    queues = std::vector<Queue>(thread_num);
+    jobs_done.assign(thread_num, 0);
+    jobs_stolen.assign(thread_num, 0);
+
+    // Give each worker a contiguous block, so neighbouring jobs stay on one thread
+    for (int w = 0; w < thread_num; w++) {
+        int first = int(int64_t(job_num) * w / thread_num);
+        int last = int(int64_t(job_num) * (w + 1) / thread_num);
+        for (int i = first; i < last; i++) {
+            queues[w].jobs.push_back(i);
+        }
+    }
+
+    std::vector<std::thread> threads;
+    for (int w = 1; w < thread_num; w++) {
+        threads.emplace_back(&Work_Stealing_Pool::work, this, w, std::cref(job));
+    }
+    work(0, job);
+    for (std::thread &t : threads) {
+        t.join();
+    }
+}
+
+bool Work_Stealing_Pool::pop_local(int worker, int &job)
+{
+    Queue &queue = queues[worker];
+    std::lock_guard<std::mutex> guard(queue.lock);
+    if (queue.jobs.empty()) {
+        return false;
+    }
+    job = queue.jobs.back();
+    queue.jobs.pop_back();
+    return true;
+}
+
+bool Work_Stealing_Pool::steal(int worker, int &job)
+{
+    // Take from the opposite end than the owner, starting with the next worker
+    for (int k = 1; k < thread_num; k++) {
+        Queue &victim = queues[(worker + k) % thread_num];
+        std::lock_guard<std::mutex> guard(victim.lock);
+        if (!victim.jobs.empty()) {
+            job = victim.jobs.front();
+            victim.jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void Work_Stealing_Pool::work(int worker, const std::function<void(int, int)> &job)
+{
+    // No job is ever added during a run, so empty queues everywhere means done
+    int index;
+    while (true) {
+        if (pop_local(worker, index)) {
+            job(index, worker);
+        }
+        else if (steal(worker, index)) {
+            jobs_stolen[worker]++;
+            job(index, worker);
+        }
+        else {
+            break;
+        }
+        jobs_done[worker]++;
+    }
+}
@@ -4,26 +4,28 @@
 #include <fstream>
 #include <utility>
 #include <algorithm>
+#include <cmath>
 
 Unit::Unit()
 {
-    id = unit_id_factory++;
+    id = -1;
+    generation = 0;
+    type = Unit_Type::bg_black;
+    direction = Direction::up;
     is_visible = false;
+    box_min = glm::vec2(0.0f, 0.0f);
+    box_max = glm::vec2(0.0f, 0.0f);
 }
 
 void Unit::init(Unit_Type unit_type, int row, int col)
 {
+    generation += 1;
     type = unit_type;
     direction = Direction::up;
     is_visible = true;
 
-    // set the upper left corner
-    upleft.x = -1.0f + col * BLOCK_WIDTH;
-    upleft.y = 1.0f - row * BLOCK_WIDTH;
-
-    // set the lower right corner
-    downright.x = -1.0f + (col + 1) * BLOCK_WIDTH;
-    downright.y = 1.0f - (row + 1) * BLOCK_WIDTH;
+    box_min = glm::vec2(col * BLOCK_WIDTH, row * BLOCK_WIDTH);
+    box_max = glm::vec2((col + 1) * BLOCK_WIDTH, (row + 1) * BLOCK_WIDTH);
 }
 
 bool Unit::change_direction(Direction direction)
@@ -32,36 +34,13 @@ bool Unit::change_direction(Direction direction)
         return false;
     }
 
-    if (this->direction == Direction::up && direction == Direction::down ||
-        this->direction == Direction::down && direction == Direction::up ||
-        this->direction == Direction::left && direction == Direction::right ||
-        this->direction == Direction::right && direction == Direction::left)
-    {
-        std::swap(this->upleft, this->downright);
-    }
-    else
-        if (this->direction == Direction::up && direction == Direction::right ||
-            this->direction == Direction::right && direction == Direction::up ||
-            this->direction == Direction::down && direction == Direction::left ||
-            this->direction == Direction::left && direction == Direction::down)
-        {
-            std::swap(this->upleft.x, this->downright.x);
-        }
-        else
-            if (this->direction == Direction::up && direction == Direction::left ||
-                this->direction == Direction::left && direction == Direction::up ||
-                this->direction == Direction::down && direction == Direction::right ||
-                this->direction == Direction::right && direction == Direction::down)
-            {
-                std::swap(this->upleft.y, this->downright.y);
-            }
-
+    // Units are square, so turning keeps the box
     this->direction = direction;
 
     return true;
 }
 
-void Unit::move(float step)
+void Unit::move(float step, const Map &map)
 {
     float unit_width = BLOCK_WIDTH;
     if (type == Unit_Type::tank_enemy || type == Unit_Type::tank_user) {
@@ -71,136 +50,215 @@ void Unit::move(float step)
         unit_width = BULLET_WIDTH;
     }
 
+    // Advance the front edge, and bring the back edge along
     switch (direction)
     {
     case Direction::up:
-        upleft.y = std::min(1.0f, upleft.y + step);
-        downright.y = upleft.y - unit_width;
+        box_min.y = std::max(0.0f, box_min.y - step);
+        box_max.y = box_min.y + unit_width;
         break;
     case Direction::down:
-        upleft.y = std::max(-1.0f, upleft.y - step);
-        downright.y = upleft.y + unit_width;
+        box_max.y = std::min(float(map.rows), box_max.y + step);
+        box_min.y = box_max.y - unit_width;
         break;
     case Direction::left:
-        upleft.x = std::max(-1.0f, upleft.x - step);
-        downright.x = upleft.x + unit_width;
+        box_min.x = std::max(0.0f, box_min.x - step);
+        box_max.x = box_min.x + unit_width;
         break;
     case Direction::right:
-        upleft.x = std::min(1.0f, upleft.x + step);
-        downright.x = upleft.x - unit_width;
+        box_max.x = std::min(float(map.cols), box_max.x + step);
+        box_min.x = box_max.x - unit_width;
         break;
     }
 }
 
-bool Unit::is_overlap(Unit &unit)
+bool Unit::is_overlap(const Unit &unit) const
 {
-    // ref: http://www.geeksforgeeks.org/find-two-rectangles-overlap/
-
-    glm::vec2 l1(std::min(this->upleft.x, this->downright.x),
-        std::max(this->upleft.y, this->downright.y));
-    glm::vec2 r1(std::max(this->upleft.x, this->downright.x),
-        std::min(this->upleft.y, this->downright.y));
-
-    glm::vec2 l2(std::min(unit.upleft.x, unit.downright.x),
-        std::max(unit.upleft.y, unit.downright.y));
-    glm::vec2 r2(std::max(unit.upleft.x, unit.downright.x),
-        std::min(unit.upleft.y, unit.downright.y));
-
-    // if one unit is on the left side of the other
-    if (r1.x <= l2.x || r2.x <= l1.x) {
-        return false;
-    }
+    // Boxes only touching along an edge don't overlap
+    return box_max.x > unit.box_min.x && unit.box_max.x > box_min.x &&
+        box_max.y > unit.box_min.y && unit.box_max.y > box_min.y;
+}
 
-    // if one unit is on the top of the other
-    if (r1.y >= l2.y || r2.y >= l1.y) {
-        return false;
+void Unit::get_corners(glm::vec2 &upleft, glm::vec2 &downright) const
+{
+    switch (direction)
+    {
+    case Direction::up:
+        upleft = box_min;
+        downright = box_max;
+        break;
+    case Direction::down:
+        upleft = box_max;
+        downright = box_min;
+        break;
+    case Direction::left:
+        upleft = glm::vec2(box_min.x, box_max.y);
+        downright = glm::vec2(box_max.x, box_min.y);
+        break;
+    case Direction::right:
+        upleft = glm::vec2(box_max.x, box_min.y);
+        downright = glm::vec2(box_min.x, box_max.y);
+        break;
     }
-
-    return true;
 }
 
 void Tank::init(Unit_Type unit_type, int row, int col)
 {
     Unit::init(unit_type, row, col);
 
-    // set the upper left corner
-    upleft.x += TANK_WIDTH_DELTA;
-    upleft.y -= TANK_WIDTH_DELTA;
-
-    // set the lower right corner
-    downright.x -= TANK_WIDTH_DELTA;
-    downright.y += TANK_WIDTH_DELTA;
+    box_min += glm::vec2(TANK_WIDTH_DELTA, TANK_WIDTH_DELTA);
+    box_max -= glm::vec2(TANK_WIDTH_DELTA, TANK_WIDTH_DELTA);
 }
 
 void Bullet::init(Tank tank)
 {
+    generation += 1;
     owner_type = tank.type;
     type = Unit_Type::bullet;
     direction = tank.direction;
     is_visible = true;
 
+    // Just in front of the tank, centered on its barrel
+    glm::vec2 center = (tank.box_min + tank.box_max) / 2.0f;
     switch (tank.direction)
     {
     case Direction::up:
-    {
-        float center = (tank.upleft.x + tank.downright.x) / 2;
-        upleft.x = center - BULLET_WIDTH / 2;
-        upleft.y = tank.upleft.y + BULLET_WIDTH;
-        downright.x = center + BULLET_WIDTH / 2;
-        downright.y = tank.upleft.y;
-    }
-    break;
+        box_min = glm::vec2(center.x - BULLET_WIDTH / 2, tank.box_min.y - BULLET_WIDTH);
+        box_max = glm::vec2(center.x + BULLET_WIDTH / 2, tank.box_min.y);
+        break;
     case Direction::down:
-    {
-        float center = (tank.upleft.x + tank.downright.x) / 2;
-        upleft.x = center + BULLET_WIDTH / 2;
-        upleft.y = tank.upleft.y - BULLET_WIDTH;
-        downright.x = center - BULLET_WIDTH / 2;
-        downright.y = tank.upleft.y;
-    }
+        box_min = glm::vec2(center.x - BULLET_WIDTH / 2, tank.box_max.y);
+        box_max = glm::vec2(center.x + BULLET_WIDTH / 2, tank.box_max.y + BULLET_WIDTH);
         break;
     case Direction::left:
-    {
-        float center = (tank.upleft.y + tank.downright.y) / 2;
-        upleft.x = tank.upleft.x - BULLET_WIDTH;
-        upleft.y = center - BULLET_WIDTH / 2;
-        downright.x = tank.upleft.x;
-        downright.y = center + BULLET_WIDTH / 2;
-    }
+        box_min = glm::vec2(tank.box_min.x - BULLET_WIDTH, center.y - BULLET_WIDTH / 2);
+        box_max = glm::vec2(tank.box_min.x, center.y + BULLET_WIDTH / 2);
         break;
     case Direction::right:
-    {
-        float center = (tank.upleft.y + tank.downright.y) / 2;
-        upleft.x = tank.upleft.x + BULLET_WIDTH;
-        upleft.y = center + BULLET_WIDTH / 2;
-        downright.x = tank.upleft.x;
-        downright.y = center - BULLET_WIDTH / 2;
-    }
+        box_min = glm::vec2(tank.box_max.x, center.y - BULLET_WIDTH / 2);
+        box_max = glm::vec2(tank.box_max.x + BULLET_WIDTH, center.y + BULLET_WIDTH / 2);
         break;
     }
 }
 
-void Battle::init()
+Bullet::Bullet()
+{
+    type = Unit_Type::bullet;
+}
+
+void Battle::init(const Map &map, int enemy_max, int enemy_total, int bullet_max)
 {
+    assert(enemy_max > 0 && enemy_total > 0 && bullet_max > 0);
+    assert(int64_t(TANK_USER_NUM + enemy_max) * bullet_max < UNIT_ID_INDEX_MASK);
+    this->enemy_max = enemy_max;
+    this->enemy_total = enemy_total;
+    this->bullet_max = bullet_max;
+    enemy_left = enemy_total;
+
+    int num = TANK_USER_NUM + enemy_max;
+    tank.assign(num, Tank());
+    for (int i = 0; i < num; i++) {
+        tank[i].id = UNIT_ID_TANK + i;
+    }
+
+    int bullet_num = num * bullet_max;
+    bullet.assign(bullet_num, Bullet());
+    bullet_live.assign(bullet_num, -1);
+    bullet_live_pos.assign(bullet_num, -1);
+    bullet_live_num = 0;
+    bullet_free.resize(bullet_num);
+    for (int i = 0; i < bullet_num; i++) {
+        bullet[i].id = UNIT_ID_BULLET + i;
+        // Lowest slots on top of the stack
+        bullet_free[i] = bullet_num - 1 - i;
+    }
+    bullet_free_num = bullet_num;
+    tank_bullet_num.assign(num, 0);
+
+    vert.assign(size_t(num + bullet_num) * 6, 0.0f);
+    texc.assign(size_t(num + bullet_num) * 4, 0.0f);
+    sprite.assign(size_t(num + bullet_num), Sprite());
+    prev_pose.assign(size_t(num + bullet_num), Unit_Pose());
+
+    // Spawn points spread evenly over the top row: the corners and the middle
+    // by default, more when there are more enemies. Crowds that don't fit in
+    // one row fill the top rows block by block
+    int spawn_num = std::min(std::max(3, enemy_max), map.rows * map.cols);
+    spawn_block.clear();
+    for (int k = 0; k < spawn_num; k++) {
+        if (spawn_num <= map.cols) {
+            spawn_block.push_back(spawn_num == 1 ? 0 : k * (map.cols - 1) / (spawn_num - 1));
+        }
+        else {
+            spawn_block.push_back(k);
+        }
+    }
+
     // Initialize the user tank
-    tank[0].init(Unit_Type::tank_user, MAP_ROWS - 1, 3);
+    tank[0].init(Unit_Type::tank_user, map.rows - 1, map.user_spawn_col());
 
-    // Initialize the enemy tank
-    tank[1].init(Unit_Type::tank_enemy, 0, 0);
-    tank[1].change_direction(Direction::down);
-    tank[2].init(Unit_Type::tank_enemy, 0, MAP_COLS / 2);
-    tank[2].change_direction(Direction::down);
-    tank[3].init(Unit_Type::tank_enemy, 0, MAP_COLS - 1);
-    tank[3].change_direction(Direction::down);
-    enemy_num = 3;
+    // Initialize the enemy tanks, one per spawn point; the rest come later
+    enemy_num = 0;
+    for (int i = 1; i < num && i - 1 < spawn_num && enemy_num < enemy_left; i++) {
+        int block = spawn_block[i - 1];
+        Unit_Type terrain = static_cast<Unit_Type>(map.block_type[block]);
+        if (terrain == Unit_Type::brick || terrain == Unit_Type::concrete ||
+            terrain == Unit_Type::sea || terrain == Unit_Type::home)
+        {
+            continue;
+        }
+        tank[i].init(Unit_Type::tank_enemy, block / map.cols, block % map.cols);
+        tank[i].change_direction(Direction::down);
+        enemy_num += 1;
+    }
+}
+
+int Battle::tank_num() const
+{
+    return int(tank.size());
+}
+
+int Battle::spawn_bullet(int tank_idx)
+{
+    if (tank_bullet_num[tank_idx] >= bullet_max || bullet_free_num == 0) {
+        return -1;
+    }
+
+    int slot = bullet_free[--bullet_free_num];
+    bullet_live_pos[slot] = bullet_live_num;
+    bullet_live[bullet_live_num++] = slot;
+    bullet[slot].owner = tank_idx;
+    tank_bullet_num[tank_idx] += 1;
+    return slot;
+}
+
+void Battle::despawn_bullet(int slot)
+{
+    assert(bullet_live_pos[slot] >= 0);
+
+    int pos = bullet_live_pos[slot];
+    int last = bullet_live[--bullet_live_num];
+    bullet_live[pos] = last;
+    bullet_live_pos[last] = pos;
+    bullet_live_pos[slot] = -1;
+    bullet_free[bullet_free_num++] = slot;
+
+    tank_bullet_num[bullet[slot].owner] -= 1;
+    bullet[slot].is_visible = false;
 }
 
 void Battle::init_texc(std::vector<glm::mat2> &texture_mapping)
 {
+    int num = tank_num();
+
     // Set up tanks
-    for (int i = 0; i < TANK_NUM; i++) {
+    for (int i = 0; i < num; i++) {
         int st = i * 2 * 2;
         int unit_type = static_cast<int>(tank[i].type);
+        if (i > 0) {
+            // Enemy slots may not have spawned yet
+            unit_type = static_cast<int>(Unit_Type::tank_enemy);
+        }
 
         // set the upper left corner
         texc[st] = texture_mapping[unit_type][0].x;
@@ -212,8 +270,8 @@ void Battle::init_texc(std::vector<glm::mat2> &texture_mapping)
     }
 
     // Set up bullets
-    for (int i = 0; i < TANK_NUM; i++) {
-        int st = (i + TANK_NUM) * 2 * 2;
+    for (int i = 0; i < int(bullet.size()); i++) {
+        int st = (i + num) * 2 * 2;
         int unit_type = static_cast<int>(bullet[i].type);
 
         // set the upper left corner
@@ -226,19 +284,76 @@ void Battle::init_texc(std::vector<glm::mat2> &texture_mapping)
     }
 }
 
-void Battle::refresh_data()
+void Battle::save_poses()
 {
+    int num = tank_num();
+    for (int i = 0; i < num + int(bullet.size()); i++) {
+        const Unit &unit = i < num ? static_cast<const Unit&>(tank[i]) : bullet[i - num];
+        Unit_Pose &pose = prev_pose[i];
+        pose.box_min = unit.box_min;
+        pose.box_max = unit.box_max;
+        pose.direction = unit.direction;
+        pose.is_visible = unit.is_visible;
+    }
+}
+
+// A unit between its previous and current tick states
+static Unit interpolate(const Unit_Pose &prev, const Unit &cur, float alpha)
+{
+    Unit unit = cur;
+
+    // Only blend continuous motion, not turns, spawns or teleports
+    glm::vec2 delta = cur.box_min - prev.box_min;
+    if (prev.is_visible && prev.direction == cur.direction &&
+        std::abs(delta.x) <= BLOCK_WIDTH && std::abs(delta.y) <= BLOCK_WIDTH)
+    {
+        unit.box_min = prev.box_min + (cur.box_min - prev.box_min) * alpha;
+        unit.box_max = prev.box_max + (cur.box_max - prev.box_max) * alpha;
+    }
+    return unit;
+}
+
+static Sprite make_sprite(const Map &map, const Unit &unit, float depth)
+{
+    glm::vec2 upleft = map.to_screen(unit.box_min);
+    glm::vec2 downright = map.to_screen(unit.box_max);
+
+    Sprite sprite;
+    sprite.rect[0] = upleft.x;
+    sprite.rect[1] = upleft.y;
+    sprite.rect[2] = downright.x;
+    sprite.rect[3] = downright.y;
+    sprite.tile = float(static_cast<int>(unit.type));
+    sprite.depth = depth;
+    sprite.direction = float(static_cast<int>(unit.direction));
+    return sprite;
+}
+
+void Battle::refresh_data(const Map &map)
+{
+    save_poses();
+    refresh_data(map, 1.0f);
+}
+
+void Battle::refresh_data(const Map &map, float alpha)
+{
+    glm::vec2 upleft, downright;
+    int num = tank_num();
+
     // Tanks
-    for (int i = 0; i < TANK_NUM; i++)
+    for (int i = 0; i < num; i++)
     {
         int st = i * 6;
         if (tank[i].is_visible)
         {
-            vert[st] = tank[i].upleft.x;
-            vert[st + 1] = tank[i].upleft.y;
+            interpolate(prev_pose[i], tank[i], alpha).get_corners(upleft, downright);
+            upleft = map.to_screen(upleft);
+            downright = map.to_screen(downright);
+            vert[st] = upleft.x;
+            vert[st + 1] = upleft.y;
             vert[st + 2] = 0.1f;
-            vert[st + 3] = tank[i].downright.x;
-            vert[st + 4] = tank[i].downright.y;
+            vert[st + 3] = downright.x;
+            vert[st + 4] = downright.y;
             vert[st + 5] = 0.1f;
         }
         else {
@@ -248,16 +363,19 @@ void Battle::refresh_data()
     }
 
     // Bullets
-    for (int i = 0; i < TANK_NUM; i++)
+    for (int i = 0; i < int(bullet.size()); i++)
     {
-        int st = (i + TANK_NUM) * 6;
+        int st = (i + num) * 6;
         if (bullet[i].is_visible)
         {
-            vert[st] = bullet[i].upleft.x;
-            vert[st + 1] = bullet[i].upleft.y;
+            interpolate(prev_pose[i + num], bullet[i], alpha).get_corners(upleft, downright);
+            upleft = map.to_screen(upleft);
+            downright = map.to_screen(downright);
+            vert[st] = upleft.x;
+            vert[st + 1] = upleft.y;
             vert[st + 2] = 0.0f;
-            vert[st + 3] = bullet[i].downright.x;
-            vert[st + 4] = bullet[i].downright.y;
+            vert[st + 3] = downright.x;
+            vert[st + 4] = downright.y;
             vert[st + 5] = 0.0f;
         }
         else {
@@ -267,10 +385,28 @@ void Battle::refresh_data()
     }
 }
 
+int Battle::refresh_sprites(const Map &map, float alpha)
+{
+    int num = 0;
+    int tanks = tank_num();
+    for (int i = 0; i < tanks; i++) {
+        if (tank[i].is_visible) {
+            sprite[num++] = make_sprite(map, interpolate(prev_pose[i], tank[i], alpha), 0.1f);
+        }
+    }
+    for (int k = 0; k < bullet_live_num; k++) {
+        int i = bullet_live[k];
+        if (bullet[i].is_visible) {
+            sprite[num++] = make_sprite(map, interpolate(prev_pose[tanks + i], bullet[i], alpha), 0.0f);
+        }
+    }
+    return num;
+}
+
 void Battle::print()
 {
     printf("The tanks are defined as following (vertices.xy, texCoords.uv):\n");
-    for (int i = 0; i < TANK_NUM; i++) {
+    for (int i = 0; i < tank_num(); i++) {
         int st_v = i * 6;
         int st_t = i * 4;
         for (int k = 0; k < 2; k++) {
@@ -288,10 +424,11 @@ void Battle::print()
 void Map::init_texc(std::vector<glm::mat2> &texture_mapping)
 {
 	// Initialize texture coordinates
-	for (int i = 0; i < MAP_ROWS; i++) {
-		for (int j = 0; j < MAP_COLS; j++) {
-			int st = (i * MAP_COLS + j) * 4;
-			int unit_type = static_cast<int>(block[i][j].type);
+    texc.resize(size_t(rows) * cols * 4);
+	for (int i = 0; i < rows; i++) {
+		for (int j = 0; j < cols; j++) {
+			size_t st = (size_t(i) * cols + j) * 4;
+			int unit_type = block_type[size_t(i) * cols + j];
 
 			// set the upper left corner
 			texc[st] = texture_mapping[unit_type][0].x;
@@ -304,73 +441,355 @@ void Map::init_texc(std::vector<glm::mat2> &texture_mapping)
 	}
 }
 
-void Map::read_map(std::string filename)
+bool Map::read_map(std::string filename)
 {
 	std::ifstream fin;
 	fin.open(filename, std::ifstream::in);
-	assert(fin.is_open());
-	int r, c;
+	if (!fin.is_open()) {
+        fprintf(stderr, "Failed to open map %s\n", filename.c_str());
+        return false;
+    }
+	int r = 0, c = 0;
 	fin >> r >> c;
-	assert(r == MAP_ROWS && c == MAP_COLS);
+	if (!fin || r <= 0 || c <= 0 || r > MAP_MAX_SIZE || c > MAP_MAX_SIZE) {
+        fprintf(stderr, "Bad map size in %s, expected 1 to %d rows and columns\n",
+            filename.c_str(), MAP_MAX_SIZE);
+        return false;
+    }
 
-	for (int i = 0; i < r; i++) {
-		for (int j = 0; j < c; j++) {
-			int type;
-			fin >> type;
-            block[i][j].init(static_cast<Unit_Type>(type), i, j);
-		}
+    rows = r;
+    cols = c;
+    block_type.assign(size_t(r) * c, static_cast<unsigned char>(Unit_Type::bg_black));
+    block_visible.assign(size_t(r) * c, 1);
+    vert.clear();
+    texc.clear();
+    sprite.clear();
+    dirty_blocks.clear();
+    is_all_dirty = true;
+
+	block_solid.assign(size_t(r) * c, 0);
+    mask_words = (c + 63) / 64;
+    tank_mask.assign(size_t(r) * mask_words, 0);
+    bullet_mask.assign(size_t(r) * mask_words, 0);
+	for (size_t i = 0; i < block_type.size(); i++) {
+		int type = 0;
+		fin >> type;
+        if (!fin || type < int(Unit_Type::bg_black) || type > int(Unit_Type::home)) {
+            fprintf(stderr, "Bad block %zu in map %s\n", i, filename.c_str());
+            return false;
+        }
+        block_type[i] = static_cast<unsigned char>(type);
+
+        switch (static_cast<Unit_Type>(type)) {
+        case Unit_Type::brick:
+        case Unit_Type::concrete:
+        case Unit_Type::home:
+            set_solid(int(i), BLOCK_STOPS_TANK | BLOCK_STOPS_BULLET);
+            break;
+        case Unit_Type::sea:
+            // Bullets fly over the water
+            set_solid(int(i), BLOCK_STOPS_TANK);
+            break;
+        default:
+            break;
+        }
 	}
 
 	fin.close();
+    return true;
 }
 
-bool Map::has_reached_edge(Unit &unit)
+int Map::user_spawn_col() const
 {
-    return (unit.direction == Direction::up && unit.upleft.y == 1.0f) ||
-        (unit.direction == Direction::down && unit.upleft.y == -1.0f) ||
-        (unit.direction == Direction::left && unit.upleft.x == -1.0f) ||
-        (unit.direction == Direction::right && unit.upleft.x == 1.0f);
+    return std::min(3, cols - 1);
 }
 
-void Map::refresh_data()
+Unit Map::block(int row, int col) const
 {
-    for (int i = 0; i < MAP_ROWS; i++) {
-        for (int j = 0; j < MAP_COLS; j++) {
-            int st = (i * MAP_COLS + j) * 6;
+    size_t idx = size_t(row) * cols + col;
 
-            if (block[i][j].is_visible) {
-                // set the upper left corner
-                vert[st] = block[i][j].upleft.x;
-                vert[st + 1] = block[i][j].upleft.y;
+    Unit unit;
+    unit.id = int(idx);
+    unit.init(static_cast<Unit_Type>(block_type[idx]), row, col);
+    unit.is_visible = block_visible[idx] != 0;
+    return unit;
+}
+
+uint64_t Map::hash()
+{
+    int size[2] = { rows, cols };
+    uint64_t h = hash_bytes(size, sizeof(size));
+    return hash_bytes(block_type.data(), block_type.size(), h);
+}
+
+bool Map::has_reached_edge(const Unit &unit) const
+{
+    return (unit.direction == Direction::up && unit.box_min.y <= 0.0f) ||
+        (unit.direction == Direction::down && unit.box_max.y >= rows) ||
+        (unit.direction == Direction::left && unit.box_min.x <= 0.0f) ||
+        (unit.direction == Direction::right && unit.box_max.x >= cols);
+}
+
+void Map::set_solid(int id, unsigned char stops)
+{
+    block_solid[id] = stops;
 
-                // set the lower right corner
-                vert[st + 3] = block[i][j].downright.x;
-                vert[st + 4] = block[i][j].downright.y;
+    int row = id / cols, col = id % cols;
+    size_t word = size_t(row) * mask_words + col / 64;
+    uint64_t bit = uint64_t(1) << (col % 64);
+    tank_mask[word] = (stops & BLOCK_STOPS_TANK) != 0 ? tank_mask[word] | bit : tank_mask[word] & ~bit;
+    bullet_mask[word] = (stops & BLOCK_STOPS_BULLET) != 0 ? bullet_mask[word] | bit : bullet_mask[word] & ~bit;
+}
+
+void Map::destroy_block(int id)
+{
+    block_visible[id] = 0;
+    set_solid(id, 0);
+    if (!is_all_dirty) {
+        dirty_blocks.push_back(id);
+    }
+}
+
+// Blocks from the one holding lo to the last one starting before hi, clamped
+// to [0, num); conversions instead of std::floor and std::ceil, which are
+// library calls without SSE4.1
+static void block_span(float lo, float hi, int num, int &first, int &last)
+{
+    lo /= BLOCK_WIDTH;
+    hi /= BLOCK_WIDTH;
+    first = lo > 0.0f ? int(lo) : 0;
+    last = hi > 0.0f ? int(hi) : -1;
+    if (last >= 0 && float(last) == hi) {
+        last--;
+    }
+    last = std::min(num - 1, last);
+}
+
+// Bits of word w of a mask row that hold the columns col_lo to col_hi
+static uint64_t word_span(int w, int col_lo, int col_hi)
+{
+    uint64_t span = w == col_lo / 64 ? ~uint64_t(0) << (col_lo % 64) : ~uint64_t(0);
+    return w == col_hi / 64 ? span & (~uint64_t(0) >> (63 - col_hi % 64)) : span;
+}
+
+bool Map::is_blocked(const Unit &unit, unsigned char stops) const
+{
+    int col_lo, col_hi, row_lo, row_hi;
+    block_span(unit.box_min.x, unit.box_max.x, cols, col_lo, col_hi);
+    block_span(unit.box_min.y, unit.box_max.y, rows, row_lo, row_hi);
+    if (col_lo > col_hi || row_lo > row_hi) {
+        return false;
+    }
+
+    // Only the rows under the box, and the words holding its columns: a
+    // single word unless the box straddles a multiple of 64
+    const uint64_t *tank = (stops & BLOCK_STOPS_TANK) != 0 ? tank_mask.data() : nullptr;
+    const uint64_t *bullet = (stops & BLOCK_STOPS_BULLET) != 0 ? bullet_mask.data() : nullptr;
+    for (int i = row_lo; i <= row_hi; i++) {
+        size_t row = size_t(i) * mask_words;
+        for (int w = col_lo / 64; w <= col_hi / 64; w++) {
+            uint64_t solid = (tank != nullptr ? tank[row + w] : 0) | (bullet != nullptr ? bullet[row + w] : 0);
+            if ((solid & word_span(w, col_lo, col_hi)) != 0) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+uint64_t Map::blocked_units(const Unit *const *units, int num, unsigned char stops) const
+{
+    assert(num <= 64);
+
+    // The spans of every unit first, then each row under any of them once:
+    // a word of the masks is read once for all the units in it, in order, and
+    // ANDed with each unit's span. A unit found blocked is not checked again
+    int col_lo[64], col_hi[64], row_lo[64], row_hi[64];
+    int first_row = rows, last_row = -1;
+    uint64_t pending = 0;
+    for (int k = 0; k < num; k++) {
+        block_span(units[k]->box_min.x, units[k]->box_max.x, cols, col_lo[k], col_hi[k]);
+        block_span(units[k]->box_min.y, units[k]->box_max.y, rows, row_lo[k], row_hi[k]);
+        if (col_lo[k] <= col_hi[k] && row_lo[k] <= row_hi[k]) {
+            pending |= uint64_t(1) << k;
+            first_row = std::min(first_row, row_lo[k]);
+            last_row = std::max(last_row, row_hi[k]);
+        }
+    }
 
-                // set the depth
-                if (block[i][j].type == Unit_Type::forest) {
-                    vert[st + 2] = vert[st + 5] = -0.5f;
+    const uint64_t *tank = (stops & BLOCK_STOPS_TANK) != 0 ? tank_mask.data() : nullptr;
+    const uint64_t *bullet = (stops & BLOCK_STOPS_BULLET) != 0 ? bullet_mask.data() : nullptr;
+    uint64_t blocked = 0;
+    for (int i = first_row; i <= last_row && pending != 0; i++) {
+        size_t row = size_t(i) * mask_words;
+        int loaded = -1;
+        uint64_t solid = 0;
+        for (int k = 0; k < num; k++) {
+            uint64_t bit = uint64_t(1) << k;
+            if ((pending & bit) == 0 || i < row_lo[k] || i > row_hi[k]) {
+                continue;
+            }
+            for (int w = col_lo[k] / 64; w <= col_hi[k] / 64; w++) {
+                if (w != loaded) {
+                    solid = (tank != nullptr ? tank[row + w] : 0) | (bullet != nullptr ? bullet[row + w] : 0);
+                    loaded = w;
                 }
-                else {
-                    vert[st + 2] = vert[st + 5] = 0.5f;
+                if ((solid & word_span(w, col_lo[k], col_hi[k])) != 0) {
+                    blocked |= bit;
+                    pending &= ~bit;
+                    break;
                 }
             }
+        }
+    }
+    return blocked;
+}
+
+float Map::sweep_solid_blocks(const Unit &unit, float dist, unsigned char stops,
+    int ids[4], int &id_num) const
+{
+    bool is_vertical = unit.direction == Direction::up || unit.direction == Direction::down;
+    bool is_forward = unit.direction == Direction::down || unit.direction == Direction::right;
+
+    // Extent of the unit along its way, and across it
+    float lo = is_vertical ? unit.box_min.y : unit.box_min.x;
+    float hi = is_vertical ? unit.box_max.y : unit.box_max.x;
+    float side_lo = is_vertical ? unit.box_min.x : unit.box_min.y;
+    float side_hi = is_vertical ? unit.box_max.x : unit.box_max.y;
+    int line_num = is_vertical ? rows : cols;
+    int side_num = is_vertical ? cols : rows;
+    int side_first = std::max(0, int(std::floor(side_lo / BLOCK_WIDTH)));
+    int side_last = std::min(side_num - 1, int(std::ceil(side_hi / BLOCK_WIDTH)) - 1);
+
+    id_num = 0;
+    int first = is_forward ? int(std::floor(lo / BLOCK_WIDTH)) : int(std::ceil(hi / BLOCK_WIDTH)) - 1;
+    int step = is_forward ? 1 : -1;
+    for (int line = first; line >= 0 && line < line_num; line += step) {
+        // Distance travelled when the front edge enters the line
+        float enter = is_forward ? line * BLOCK_WIDTH - hi : lo - (line + 1) * BLOCK_WIDTH;
+        enter = std::max(0.0f, enter);
+        if (enter > 0.0f && enter >= dist) {
+            break;
+        }
+
+        for (int side = side_first; side <= side_last && id_num < 4; side++) {
+            int id = is_vertical ? line * cols + side : side * cols + line;
+            if ((block_solid[id] & stops) != 0) {
+                ids[id_num++] = id;
+            }
+        }
+        if (id_num > 0) {
+            return enter;
+        }
+    }
+    return dist;
+}
+
+glm::vec2 Map::to_screen(glm::vec2 pos) const
+{
+    return glm::vec2(-1.0f + pos.x * 2.0f / cols, 1.0f - pos.y * 2.0f / rows);
+}
+
+template<typename Refresh>
+void Map::refresh_dirty(bool is_resized, Refresh refresh)
+{
+    block_changed.clear();
+    if (is_all_dirty || is_resized) {
+        for (size_t idx = 0; idx < size_t(rows) * cols; idx++) {
+            refresh(idx);
+        }
+        block_changed.push_back(Block_Range{ 0, rows * cols });
+    }
+    else {
+        // Neighbouring blocks are uploaded as one range
+        std::sort(dirty_blocks.begin(), dirty_blocks.end());
+        for (int id : dirty_blocks) {
+            if (!block_changed.empty() && block_changed.back().first + block_changed.back().num >= id + 1) {
+                // Listed twice
+                continue;
+            }
+            if (!block_changed.empty() && block_changed.back().first + block_changed.back().num == id) {
+                block_changed.back().num += 1;
+            }
             else {
-                vert[st] = vert[st + 1] = vert[st + 3] = vert[st + 4] = 0.0f;
-                vert[st + 2] = vert[st + 5] = 1.0f;
+                block_changed.push_back(Block_Range{ id, 1 });
             }
+            refresh(size_t(id));
         }
     }
+    dirty_blocks.clear();
+    is_all_dirty = false;
+}
+
+void Map::refresh_data()
+{
+    size_t size = size_t(rows) * cols * 6;
+    bool is_resized = vert.size() != size;
+    vert.resize(size);
+    refresh_dirty(is_resized, [this](size_t idx) { refresh_block(idx); });
+}
+
+void Map::refresh_sprites()
+{
+    size_t size = size_t(rows) * cols;
+    bool is_resized = sprite.size() != size;
+    sprite.resize(size);
+    refresh_dirty(is_resized, [this](size_t idx) { refresh_sprite(idx); });
+}
+
+void Map::refresh_block(size_t idx)
+{
+    int i = int(idx / cols), j = int(idx % cols);
+    size_t st = idx * 6;
+
+    if (block_visible[idx]) {
+        glm::vec2 upleft = to_screen(glm::vec2(float(j), float(i)));
+        glm::vec2 downright = to_screen(glm::vec2(float(j + 1), float(i + 1)));
+
+        // set the upper left corner
+        vert[st] = upleft.x;
+        vert[st + 1] = upleft.y;
+
+        // set the lower right corner
+        vert[st + 3] = downright.x;
+        vert[st + 4] = downright.y;
+
+        // set the depth
+        if (block_type[idx] == static_cast<unsigned char>(Unit_Type::forest)) {
+            vert[st + 2] = vert[st + 5] = -0.5f;
+        }
+        else {
+            vert[st + 2] = vert[st + 5] = 0.5f;
+        }
+    }
+    else {
+        vert[st] = vert[st + 1] = vert[st + 3] = vert[st + 4] = 0.0f;
+        vert[st + 2] = vert[st + 5] = 1.0f;
+    }
+}
+
+void Map::refresh_sprite(size_t idx)
+{
+    Sprite &s = sprite[idx];
+    if (block_visible[idx]) {
+        Unit unit = block(int(idx / cols), int(idx % cols));
+        s = make_sprite(*this, unit,
+            block_type[idx] == static_cast<unsigned char>(Unit_Type::forest) ? -0.5f : 0.5f);
+    }
+    else {
+        s = Sprite();
+        s.depth = 1.0f;
+    }
 }
 
 void Map::print()
 {
 	printf("The Map is defined as following (vertices.xy, texCoords.uv):\n");
-	for (int i = 0; i < MAP_ROWS; i++) {
-		for (int j = 0; j < MAP_COLS; j++) {
+	for (int i = 0; i < rows; i++) {
+		for (int j = 0; j < cols; j++) {
 			printf("Block %d, %d\n", i, j);
-			int st_v = (i * MAP_COLS + j) * 6;
-			int st_t = (i * MAP_COLS + j) * 4;
+			size_t st_v = (size_t(i) * cols + j) * 6;
+			size_t st_t = (size_t(i) * cols + j) * 4;
 			for (int k = 0; k < 2; k++) {
 				printf("%.2f\t%.2f\t%.2f\t%.2f\t%.2f\n",
 					vert[st_v + k * 2],
@@ -384,66 +803,317 @@ void Map::print()
 	}
 }
 
-int Collision_Grid::get_grid_index(float x, float y)
+template<typename Cells>
+void Cell_Lists<Cells>::init_nodes(int rows, int cols, float cell_width, int node_num)
 {
-    int i = std::min(int((y - 1.0f) / -BLOCK_WIDTH), MAP_ROWS - 1);
-    int j = std::min(int((x + 1.0f) / BLOCK_WIDTH), MAP_COLS - 1);
-    return i * MAP_COLS + j;
+    this->rows = rows;
+    this->cols = cols;
+    this->cell_width = cell_width;
+
+    node.resize(node_num);
+    for (int n = 0; n < node_num; n++) {
+        node[n].id = -1;
+        node[n].next = n + 1 < node_num ? n + 1 : -1;
+        node[n].first = -1;
+    }
+    free_node = node_num > 0 ? 0 : -1;
 }
 
-std::set<int> Collision_Grid::get_grids_touched(Unit &unit, bool by_center)
+template<typename Cells>
+int Cell_Lists<Cells>::get_grid_index(float x, float y) const
 {
-    std::set<int> grids_touched;
+    int i = std::max(0, std::min(int(y / cell_width), rows - 1));
+    int j = std::max(0, std::min(int(x / cell_width), cols - 1));
+    return i * cols + j;
+}
 
+template<typename Cells>
+int Cell_Lists<Cells>::get_cells_touched(const Unit &unit, bool by_center, int cells[4]) const
+{
     if (by_center) {
-        glm::vec2 center = (unit.upleft + unit.downright) / 2.0f;
-        grids_touched.insert(get_grid_index(center.x, center.y));
+        glm::vec2 center = (unit.box_min + unit.box_max) / 2.0f;
+        cells[0] = get_grid_index(center.x, center.y);
+        return 1;
     }
-    else {
-        grids_touched.insert(get_grid_index(unit.upleft.x, unit.upleft.y));
-        grids_touched.insert(get_grid_index(unit.upleft.x, unit.downright.y));
-        grids_touched.insert(get_grid_index(unit.downright.x, unit.upleft.y));
-        grids_touched.insert(get_grid_index(unit.downright.x, unit.downright.y));
+
+    int corners[4] = {
+        get_grid_index(unit.box_min.x, unit.box_min.y),
+        get_grid_index(unit.box_min.x, unit.box_max.y),
+        get_grid_index(unit.box_max.x, unit.box_min.y),
+        get_grid_index(unit.box_max.x, unit.box_max.y)
+    };
+    int cell_num = 0;
+    for (int k = 0; k < 4; k++) {
+        if (std::find(cells, cells + cell_num, corners[k]) == cells + cell_num) {
+            cells[cell_num++] = corners[k];
+        }
     }
+    return cell_num;
+}
 
-    return grids_touched;
+template<typename Cells>
+bool Cell_Lists<Cells>::contains(int cell, int id) const
+{
+    for (int n = cells().cell_head(cell); n >= 0; n = node[n].next) {
+        if (node[n].id == id) {
+            return true;
+        }
+    }
+    return false;
 }
 
-void Collision_Grid::put(Unit &unit, bool by_center)
+template<typename Cells>
+void Cell_Lists<Cells>::put(Unit &unit, bool by_center)
 {
-    for (int grid_idx : get_grids_touched(unit, by_center)) {
-        grid[grid_idx][unit.id] = &unit;
+    int cells[4];
+    int cell_num = get_cells_touched(unit, by_center, cells);
+    // The first cell is the upper left one
+    for (int c = 0; c < cell_num; c++) {
+        if (!contains(cells[c], unit.id)) {
+            link(cells[c], unit.id, cells[0]);
+        }
     }
 }
 
-void Collision_Grid::remove(Unit &unit, bool by_center)
+template<typename Cells>
+void Cell_Lists<Cells>::remove(Unit &unit, bool by_center)
 {
-    for (int grid_idx : get_grids_touched(unit, by_center)) {
-        grid[grid_idx].erase(unit.id);
+    int cells[4];
+    int cell_num = get_cells_touched(unit, by_center, cells);
+    for (int c = 0; c < cell_num; c++) {
+        unlink(cells[c], unit.id);
     }
 }
 
-std::vector<Unit*> Collision_Grid::check_collision(Unit &unit)
+template<typename Cells>
+void Cell_Lists<Cells>::update(const Unit &before, Unit &unit)
 {
-    std::vector<Unit*> unit_collides;
+    int old_cells[4], new_cells[4];
+    int old_num = get_cells_touched(before, false, old_cells);
+    int new_num = get_cells_touched(unit, false, new_cells);
 
-    for (int grid_idx : get_grids_touched(unit, false)) {
-        for (std::pair<int, Unit*> kv : grid[grid_idx]) {
-            if (unit.id != kv.first && unit.is_overlap(*kv.second)) {
-                unit_collides.push_back(kv.second);
-            }
+    // Removing and putting it again would write every cell twice
+    for (int c = 0; c < old_num; c++) {
+        if (std::find(new_cells, new_cells + new_num, old_cells[c]) == new_cells + new_num) {
+            unlink(old_cells[c], unit.id);
+        }
+        else if (old_cells[0] != new_cells[0]) {
+            // Kept, but the unit now starts in another cell
+            set_first(old_cells[c], unit.id, new_cells[0]);
+        }
+        else {
+            saved_write_num += 2;
+        }
+    }
+    for (int c = 0; c < new_num; c++) {
+        if (std::find(old_cells, old_cells + old_num, new_cells[c]) == old_cells + old_num) {
+            link(new_cells[c], unit.id, new_cells[0]);
         }
     }
+}
+
+template<typename Cells>
+void Cell_Lists<Cells>::link(int cell, int id, int first)
+{
+    // init sized the pool for every membership, so it never grows and a
+    // snapshot can be restored without allocating
+    int n = free_node;
+    assert(n >= 0);
+    free_node = node[n].next;
+
+    int &head = cells().claim_head(cell);
+    node[n].id = id;
+    node[n].next = head;
+    node[n].first = first;
+    head = n;
+    write_num++;
+}
+
+template<typename Cells>
+void Cell_Lists<Cells>::unlink(int cell, int id)
+{
+    int &head = cells().claim_head(cell);
+    int *link = &head;
+    while (*link >= 0) {
+        int n = *link;
+        if (node[n].id == id) {
+            *link = node[n].next;
+            node[n].next = free_node;
+            free_node = n;
+            write_num++;
+            break;
+        }
+        link = &node[n].next;
+    }
+    if (head < 0) {
+        cells().release_cell(cell);
+    }
+}
+
+template<typename Cells>
+void Cell_Lists<Cells>::set_first(int cell, int id, int first)
+{
+    for (int n = cells().cell_head(cell); n >= 0; n = node[n].next) {
+        if (node[n].id == id) {
+            node[n].first = first;
+            write_num++;
+            return;
+        }
+    }
+}
+
+void Collision_Grid::init(int rows, int cols, int node_num)
+{
+    head.assign(size_t(rows) * cols, -1);
+    init_nodes(rows, cols, BLOCK_WIDTH, node_num);
+}
+
+// Home slot of a cell in a table of 1 << bits slots (Fibonacci hashing)
+static int hash_cell(int cell, int bits)
+{
+    return int((uint32_t(cell) * 2654435769u) >> (32 - bits));
+}
+
+void Spatial_Hash::init(int map_rows, int map_cols, int cell_size, int node_num)
+{
+    this->cell_size = std::max(1, cell_size);
+    int rows = (map_rows + this->cell_size - 1) / this->cell_size;
+    int cols = (map_cols + this->cell_size - 1) / this->cell_size;
+
+    // A unit is in up to four cells, one node each, so no more cells than
+    // nodes are in use; keep the table at most half full
+    slot_bits = 4;
+    while ((1 << slot_bits) < 2 * node_num) {
+        slot_bits++;
+    }
+    Hash_Slot empty = { -1, -1 };
+    slot.assign(size_t(1) << slot_bits, empty);
+
+    init_nodes(rows, cols, BLOCK_WIDTH * this->cell_size, node_num);
+}
+
+int Spatial_Hash::find_slot(int cell) const
+{
+    int mask = int(slot.size()) - 1;
+    int s = hash_cell(cell, slot_bits);
+    while (slot[s].cell >= 0 && slot[s].cell != cell) {
+        s = (s + 1) & mask;
+    }
+    return s;
+}
+
+int Spatial_Hash::cell_head(int cell) const
+{
+    return slot[find_slot(cell)].head;
+}
 
-    return unit_collides;
+int &Spatial_Hash::claim_head(int cell)
+{
+    int s = find_slot(cell);
+    if (slot[s].cell < 0) {
+        assert(node.size() * 2 <= slot.size());
+        slot[s].cell = cell;
+    }
+    return slot[s].head;
+}
+
+void Spatial_Hash::release_cell(int cell)
+{
+    // Free the slot of the empty cell, shifting back the following entries
+    // of the probe sequence that may take its place, so lookups never need
+    // tombstones
+    int mask = int(slot.size()) - 1;
+    int hole = find_slot(cell);
+    for (int k = (hole + 1) & mask; slot[k].cell >= 0; k = (k + 1) & mask) {
+        int home = hash_cell(slot[k].cell, slot_bits);
+        if (((k - home) & mask) >= ((k - hole) & mask)) {
+            slot[hole] = slot[k];
+            hole = k;
+        }
+    }
+    slot[hole].cell = -1;
+    slot[hole].head = -1;
+}
+
+template class Cell_Lists<Collision_Grid>;
+template class Cell_Lists<Spatial_Hash>;
+
+// Order of the Sweep_List
+static bool sweep_less(const Sweep_Entry &a, const Sweep_Entry &b)
+{
+    return a.min_x < b.min_x || (a.min_x == b.min_x && a.id < b.id);
+}
+
+static Sweep_Entry sweep_entry(const Unit &unit)
+{
+    Sweep_Entry e = { unit.box_min.x, unit.box_max.x, unit.box_min.y, unit.box_max.y, unit.id };
+    return e;
+}
+
+void Sweep_List::init(int unit_num)
+{
+    entry.clear();
+    entry.reserve(unit_num);
+    max_width = 0.0f;
+}
+
+int Sweep_List::find(const Unit &unit) const
+{
+    Sweep_Entry key = sweep_entry(unit);
+    auto it = std::lower_bound(entry.begin(), entry.end(), key, sweep_less);
+    return it != entry.end() && it->id == unit.id ? int(it - entry.begin()) : -1;
+}
+
+void Sweep_List::put(Unit &unit, bool)
+{
+    if (find(unit) >= 0) {
+        return;
+    }
+
+    Sweep_Entry e = sweep_entry(unit);
+    auto it = std::upper_bound(entry.begin(), entry.end(), e, sweep_less);
+    write_num += entry.end() - it + 1;
+    entry.insert(it, e);
+    max_width = std::max(max_width, e.max_x - e.min_x);
+}
+
+void Sweep_List::remove(Unit &unit, bool)
+{
+    int k = find(unit);
+    if (k >= 0) {
+        write_num += int(entry.size()) - k - 1;
+        entry.erase(entry.begin() + k);
+    }
+}
+
+void Sweep_List::update(const Unit &before, Unit &unit)
+{
+    int k = find(before);
+    assert(k >= 0);
+    entry[k] = sweep_entry(unit);
+    max_width = std::max(max_width, entry[k].max_x - entry[k].min_x);
+    write_num++;
+
+    // Insertion sort: the unit moved a little, so it only passes a few others
+    int n = int(entry.size());
+    while (k > 0 && sweep_less(entry[k], entry[k - 1])) {
+        std::swap(entry[k], entry[k - 1]);
+        k--;
+        write_num++;
+    }
+    while (k + 1 < n && sweep_less(entry[k + 1], entry[k])) {
+        std::swap(entry[k], entry[k + 1]);
+        k++;
+        write_num++;
+    }
 }
 
 void Collision_Grid::print()
 {
-    for (int i = 0; i < MAP_ROWS * MAP_COLS; i++){
+    for (int i = 0; i < rows * cols; i++){
         printf("Grid %d: ", i);
-        for (std::pair<int, Unit*> kv : grid[i]) {
-            printf("Unit %d, Unit Type %d; \t", kv.first, kv.second->type);
+        for (int n = head[i]; n >= 0; n = node[n].next) {
+            printf("Unit %d; \t", node[n].id);
         }
         printf("\n");
     }
@@ -23,3 +23,13 @@ void read_texture_mapping(std::string filename, std::vector<glm::mat2> &texture_
 
     fin.close();
 }
+
+uint64_t hash_bytes(const void *data, size_t size, uint64_t h)
+{
+    const unsigned char *bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        h ^= bytes[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
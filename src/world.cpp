@@ -0,0 +1,986 @@
+#include "world.hpp"
+#include "utils.hpp"
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+#include <limits>
+#include <type_traits>
+
+unsigned char Input::bits() const
+{
+    return (up ? INPUT_UP : 0) | (down ? INPUT_DOWN : 0) |
+        (left ? INPUT_LEFT : 0) | (right ? INPUT_RIGHT : 0) |
+        (fire ? INPUT_FIRE : 0);
+}
+
+Input Input::from_bits(unsigned char bits)
+{
+    Input input;
+    input.up = (bits & INPUT_UP) != 0;
+    input.down = (bits & INPUT_DOWN) != 0;
+    input.left = (bits & INPUT_LEFT) != 0;
+    input.right = (bits & INPUT_RIGHT) != 0;
+    input.fire = (bits & INPUT_FIRE) != 0;
+    return input;
+}
+
+void Random_Player::seed(uint64_t seed)
+{
+    rng.seed(seed);
+    input = Input();
+    hold = 0;
+}
+
+Input Random_Player::next()
+{
+    if (--hold <= 0) {
+        input = Input::from_bits(static_cast<unsigned char>(rng.uniform(1 << INPUT_BITS)));
+        hold = 1 + rng.uniform(TICKS_PER_SECOND);
+    }
+    return input;
+}
+
+const char *broadphase_name(Broadphase broadphase)
+{
+    switch (broadphase)
+    {
+    case Broadphase::hash: return "hash";
+    case Broadphase::sweep: return "sweep";
+    default: return "grid";
+    }
+}
+
+bool parse_broadphase(const std::string &name, Broadphase &broadphase)
+{
+    if (name == "grid") {
+        broadphase = Broadphase::grid;
+    }
+    else if (name == "hash") {
+        broadphase = Broadphase::hash;
+    }
+    else if (name == "sweep") {
+        broadphase = Broadphase::sweep;
+    }
+    else {
+        return false;
+    }
+    return true;
+}
+
+// Hash the fields of a unit one by one, so struct padding never leaks in
+static uint64_t hash_unit(const Unit &unit, uint64_t h)
+{
+    int fields[5] = {
+        unit.id,
+        static_cast<int>(unit.generation),
+        static_cast<int>(unit.type),
+        static_cast<int>(unit.direction),
+        unit.is_visible ? 1 : 0
+    };
+    float corners[4] = { unit.box_min.x, unit.box_min.y, unit.box_max.x, unit.box_max.y };
+    h = hash_bytes(fields, sizeof(fields), h);
+    return hash_bytes(corners, sizeof(corners), h);
+}
+
+bool World::init(std::string map_filename, uint64_t seed, const World_Config &config)
+{
+    this->config = config;
+    rng.seed(seed);
+    is_home_hit = false;
+    home_hit_owner = -1;
+    tick = 0;
+    if (!map.read_map(map_filename)) {
+        return false;
+    }
+    battle.init(map, config.enemy_num, config.enemy_total, config.bullet_num);
+    last_firing_tick.assign(battle.tank_num(), -FIRE_INTERVAL_TICKS);
+    contacts.clear();
+    bullet_stop_distance.assign(battle.bullet.size(), std::numeric_limits<float>::infinity());
+    tank_hit_distance.assign(battle.tank.size(), std::numeric_limits<float>::infinity());
+    block_hits.clear();
+
+    // Setting the broadphase; it only holds the tanks and the bullets, with
+    // up to four cells each
+    int node_num = 4 * int(battle.tank.size() + battle.bullet.size());
+    coll_grid = Collision_Grid();
+    spatial_hash = Spatial_Hash();
+    sweep_list = Sweep_List();
+    switch (config.broadphase)
+    {
+    case Broadphase::hash:
+        spatial_hash.init(map.rows, map.cols, config.hash_cell_size, node_num);
+        break;
+    case Broadphase::sweep:
+        sweep_list.init(int(battle.tank.size() + battle.bullet.size()));
+        break;
+    default:
+        coll_grid.init(map.rows, map.cols, node_num);
+        break;
+    }
+    for (int i = 0; i < battle.tank_num(); i++) {
+        if (battle.tank[i].is_visible) {
+            broadphase_put(battle.tank[i]);
+        }
+    }
+    reserve_scratch();
+    return true;
+}
+
+void World::clone_from(const World &other)
+{
+    *this = other;
+    reserve_scratch();
+}
+
+void World::reserve_scratch()
+{
+    // Room for the worst tick, so that stepping never allocates; a plain copy
+    // of the world only keeps what each vector holds
+    contacts.reserve(2 * battle.bullet.size());
+    block_hits.reserve(4 * battle.bullet.size());
+    if (config.broadphase == Broadphase::sweep) {
+        sweep_list.entry.reserve(battle.tank.size() + battle.bullet.size());
+    }
+}
+
+void World::broadphase_put(Unit &unit)
+{
+    switch (config.broadphase)
+    {
+    case Broadphase::hash: spatial_hash.put(unit, false); break;
+    case Broadphase::sweep: sweep_list.put(unit, false); break;
+    default: coll_grid.put(unit, false); break;
+    }
+}
+
+void World::broadphase_remove(Unit &unit)
+{
+    switch (config.broadphase)
+    {
+    case Broadphase::hash: spatial_hash.remove(unit, false); break;
+    case Broadphase::sweep: sweep_list.remove(unit, false); break;
+    default: coll_grid.remove(unit, false); break;
+    }
+}
+
+void World::broadphase_update(const Unit &before, Unit &unit)
+{
+    switch (config.broadphase)
+    {
+    case Broadphase::hash: spatial_hash.update(before, unit); break;
+    case Broadphase::sweep: sweep_list.update(before, unit); break;
+    default: coll_grid.update(before, unit); break;
+    }
+}
+
+Broadphase_Stats World::broadphase_stats() const
+{
+    Broadphase_Stats stats;
+    switch (config.broadphase)
+    {
+    case Broadphase::hash:
+        stats.write_num = spatial_hash.write_num;
+        stats.saved_write_num = spatial_hash.saved_write_num;
+        stats.bytes = spatial_hash.slot.size() * sizeof(Hash_Slot) +
+            spatial_hash.node.size() * sizeof(Grid_Node);
+        break;
+    case Broadphase::sweep:
+        stats.write_num = sweep_list.write_num;
+        stats.saved_write_num = sweep_list.saved_write_num;
+        stats.bytes = sweep_list.entry.capacity() * sizeof(Sweep_Entry);
+        break;
+    default:
+        stats.write_num = coll_grid.write_num;
+        stats.saved_write_num = coll_grid.saved_write_num;
+        stats.bytes = coll_grid.head.size() * sizeof(int) +
+            coll_grid.node.size() * sizeof(Grid_Node);
+        break;
+    }
+    return stats;
+}
+
+void World::step(const Input &input)
+{
+    tick += 1;
+
+    handle_user_tank(input);
+    handle_enemy_tanks();
+    handle_bullet_moving();
+}
+
+bool World::is_over()
+{
+    return is_home_hit || battle.enemy_left == 0;
+}
+
+bool World::is_home_in_line(const Input &input) const
+{
+    // The tank turns to the last key held before it fires
+    const Tank &tank = battle.tank[0];
+    Direction direction = tank.direction;
+    if (input.up) {
+        direction = Direction::up;
+    }
+    if (input.down) {
+        direction = Direction::down;
+    }
+    if (input.left) {
+        direction = Direction::left;
+    }
+    if (input.right) {
+        direction = Direction::right;
+    }
+
+    // The lane is as wide as the tank rather than the bullet, which covers
+    // the step the tank takes before firing, and starts behind its front
+    bool is_vertical = direction == Direction::up || direction == Direction::down;
+    int lines = is_vertical ? map.cols : map.rows;
+    int length = is_vertical ? map.rows : map.cols;
+    int col_lo = int(std::floor(tank.box_min.x));
+    int col_hi = int(std::ceil(tank.box_max.x)) - 1;
+    int row_lo = int(std::floor(tank.box_min.y));
+    int row_hi = int(std::ceil(tank.box_max.y)) - 1;
+    int lane_first = std::max(0, is_vertical ? col_lo : row_lo);
+    int lane_last = std::min(lines - 1, is_vertical ? col_hi : row_hi);
+    int first = 0;
+    int last = length - 1;
+    switch (direction)
+    {
+    case Direction::up: last = std::min(last, row_hi); break;
+    case Direction::down: first = std::max(first, row_lo); break;
+    case Direction::left: last = std::min(last, col_hi); break;
+    case Direction::right: first = std::max(first, col_lo); break;
+    }
+
+    for (int lane = lane_first; lane <= lane_last; lane++) {
+        for (int k = first; k <= last; k++) {
+            int idx = is_vertical ? k * map.cols + lane : lane * map.cols + k;
+            if (static_cast<Unit_Type>(map.block_type[idx]) == Unit_Type::home) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// The units and the broadphase pools are saved and restored as raw bytes
+static_assert(std::is_trivially_copyable<Tank>::value && std::is_trivially_copyable<Bullet>::value &&
+    std::is_trivially_copyable<Grid_Node>::value && std::is_trivially_copyable<Hash_Slot>::value &&
+    std::is_trivially_copyable<Sweep_Entry>::value, "snapshots copy these with memcpy");
+
+// Empty vectors may have no storage, and memcpy must not be given a null pointer
+static void put_bytes(unsigned char *&out, const void *data, size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    memcpy(out, data, size);
+    out += size;
+}
+
+static void get_bytes(const unsigned char *&in, void *data, size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    memcpy(data, in, size);
+    in += size;
+}
+
+size_t World::snapshot_size(int sweep_num) const
+{
+    // The pools keep their size during a match; only the number of units in
+    // the Sweep_List varies. The two indexes not in use were never initialized,
+    // so their arrays are empty and take no room in the snapshot
+    return 3 * sizeof(int) +
+        battle.tank.size() * sizeof(Tank) + battle.bullet.size() * sizeof(Bullet) +
+        (battle.bullet_live.size() + battle.bullet_live_pos.size() + battle.bullet_free.size() +
+        battle.tank_bullet_num.size()) * sizeof(int) +
+        sizeof(battle.bullet_live_num) + sizeof(battle.bullet_free_num) +
+        sizeof(battle.enemy_num) + sizeof(battle.enemy_left) + sizeof(rng) +
+        sizeof(is_home_hit) + sizeof(home_hit_owner) + sizeof(tick) + last_firing_tick.size() * sizeof(int64_t) +
+        sizeof(coll_grid.free_node) +
+        map.block_visible.size() + map.block_solid.size() +
+        (map.tank_mask.size() + map.bullet_mask.size()) * sizeof(uint64_t) +
+        coll_grid.head.size() * sizeof(int) +
+        coll_grid.node.size() * sizeof(Grid_Node) +
+        sizeof(spatial_hash.free_node) +
+        spatial_hash.slot.size() * sizeof(Hash_Slot) +
+        spatial_hash.node.size() * sizeof(Grid_Node) +
+        sizeof(sweep_list.max_width) +
+        size_t(sweep_num) * sizeof(Sweep_Entry);
+}
+
+void World::save(World_Snapshot &snapshot)
+{
+    // The pool sizes go first, so restore can check them before copying
+    int node_num = int(coll_grid.node.size());
+    int hash_node_num = int(spatial_hash.node.size());
+    int sweep_num = int(sweep_list.entry.size());
+    snapshot.data.resize(snapshot_size(sweep_num));
+
+    unsigned char *out = snapshot.data.data();
+    put_bytes(out, &node_num, sizeof(node_num));
+    put_bytes(out, &hash_node_num, sizeof(hash_node_num));
+    put_bytes(out, &sweep_num, sizeof(sweep_num));
+    put_bytes(out, battle.tank.data(), battle.tank.size() * sizeof(Tank));
+    put_bytes(out, battle.bullet.data(), battle.bullet.size() * sizeof(Bullet));
+    put_bytes(out, battle.bullet_live.data(), battle.bullet_live.size() * sizeof(int));
+    put_bytes(out, battle.bullet_live_pos.data(), battle.bullet_live_pos.size() * sizeof(int));
+    put_bytes(out, battle.bullet_free.data(), battle.bullet_free.size() * sizeof(int));
+    put_bytes(out, battle.tank_bullet_num.data(), battle.tank_bullet_num.size() * sizeof(int));
+    put_bytes(out, &battle.bullet_live_num, sizeof(battle.bullet_live_num));
+    put_bytes(out, &battle.bullet_free_num, sizeof(battle.bullet_free_num));
+    put_bytes(out, &battle.enemy_num, sizeof(battle.enemy_num));
+    put_bytes(out, &battle.enemy_left, sizeof(battle.enemy_left));
+    put_bytes(out, &rng, sizeof(rng));
+    put_bytes(out, &is_home_hit, sizeof(is_home_hit));
+    put_bytes(out, &home_hit_owner, sizeof(home_hit_owner));
+    put_bytes(out, &tick, sizeof(tick));
+    put_bytes(out, last_firing_tick.data(), last_firing_tick.size() * sizeof(int64_t));
+    put_bytes(out, &coll_grid.free_node, sizeof(coll_grid.free_node));
+    put_bytes(out, map.block_visible.data(), map.block_visible.size());
+    put_bytes(out, map.block_solid.data(), map.block_solid.size());
+    put_bytes(out, map.tank_mask.data(), map.tank_mask.size() * sizeof(uint64_t));
+    put_bytes(out, map.bullet_mask.data(), map.bullet_mask.size() * sizeof(uint64_t));
+    put_bytes(out, coll_grid.head.data(), coll_grid.head.size() * sizeof(int));
+    put_bytes(out, coll_grid.node.data(), coll_grid.node.size() * sizeof(Grid_Node));
+    put_bytes(out, &spatial_hash.free_node, sizeof(spatial_hash.free_node));
+    put_bytes(out, spatial_hash.slot.data(), spatial_hash.slot.size() * sizeof(Hash_Slot));
+    put_bytes(out, spatial_hash.node.data(), spatial_hash.node.size() * sizeof(Grid_Node));
+    put_bytes(out, &sweep_list.max_width, sizeof(sweep_list.max_width));
+    put_bytes(out, sweep_list.entry.data(), sweep_list.entry.size() * sizeof(Sweep_Entry));
+}
+
+bool World::restore(const World_Snapshot &snapshot)
+{
+    // The snapshot must come from a world playing the same map and config;
+    // check its pool sizes and length before anything is overwritten
+    int node_num, hash_node_num, sweep_num;
+    const unsigned char *in = snapshot.data.data();
+    if (snapshot.data.size() < 3 * sizeof(int)) {
+        fprintf(stderr, "Truncated snapshot, %zu bytes\n", snapshot.data.size());
+        return false;
+    }
+    get_bytes(in, &node_num, sizeof(node_num));
+    get_bytes(in, &hash_node_num, sizeof(hash_node_num));
+    get_bytes(in, &sweep_num, sizeof(sweep_num));
+    // Sweep entries within the room reserved by init, so this never allocates
+    if (node_num != int(coll_grid.node.size()) || hash_node_num != int(spatial_hash.node.size()) ||
+        sweep_num < 0 || sweep_num > int(sweep_list.entry.capacity()) ||
+        snapshot.data.size() != snapshot_size(sweep_num))
+    {
+        fprintf(stderr, "The snapshot was taken from a different map or config\n");
+        return false;
+    }
+
+    get_bytes(in, battle.tank.data(), battle.tank.size() * sizeof(Tank));
+    get_bytes(in, battle.bullet.data(), battle.bullet.size() * sizeof(Bullet));
+    get_bytes(in, battle.bullet_live.data(), battle.bullet_live.size() * sizeof(int));
+    get_bytes(in, battle.bullet_live_pos.data(), battle.bullet_live_pos.size() * sizeof(int));
+    get_bytes(in, battle.bullet_free.data(), battle.bullet_free.size() * sizeof(int));
+    get_bytes(in, battle.tank_bullet_num.data(), battle.tank_bullet_num.size() * sizeof(int));
+    get_bytes(in, &battle.bullet_live_num, sizeof(battle.bullet_live_num));
+    get_bytes(in, &battle.bullet_free_num, sizeof(battle.bullet_free_num));
+    get_bytes(in, &battle.enemy_num, sizeof(battle.enemy_num));
+    get_bytes(in, &battle.enemy_left, sizeof(battle.enemy_left));
+    get_bytes(in, &rng, sizeof(rng));
+    get_bytes(in, &is_home_hit, sizeof(is_home_hit));
+    get_bytes(in, &home_hit_owner, sizeof(home_hit_owner));
+    get_bytes(in, &tick, sizeof(tick));
+    get_bytes(in, last_firing_tick.data(), last_firing_tick.size() * sizeof(int64_t));
+    get_bytes(in, &coll_grid.free_node, sizeof(coll_grid.free_node));
+    get_bytes(in, map.block_visible.data(), map.block_visible.size());
+    map.dirty_blocks.clear();
+    map.is_all_dirty = true;
+    get_bytes(in, map.block_solid.data(), map.block_solid.size());
+    get_bytes(in, map.tank_mask.data(), map.tank_mask.size() * sizeof(uint64_t));
+    get_bytes(in, map.bullet_mask.data(), map.bullet_mask.size() * sizeof(uint64_t));
+    get_bytes(in, coll_grid.head.data(), coll_grid.head.size() * sizeof(int));
+    get_bytes(in, coll_grid.node.data(), coll_grid.node.size() * sizeof(Grid_Node));
+    get_bytes(in, &spatial_hash.free_node, sizeof(spatial_hash.free_node));
+    get_bytes(in, spatial_hash.slot.data(), spatial_hash.slot.size() * sizeof(Hash_Slot));
+    get_bytes(in, spatial_hash.node.data(), spatial_hash.node.size() * sizeof(Grid_Node));
+    get_bytes(in, &sweep_list.max_width, sizeof(sweep_list.max_width));
+    sweep_list.entry.resize(sweep_num);
+    get_bytes(in, sweep_list.entry.data(), sweep_list.entry.size() * sizeof(Sweep_Entry));
+    return true;
+}
+
+uint64_t World::hash()
+{
+    uint64_t h = HASH_INIT;
+
+    h = hash_bytes(map.block_visible.data(), map.block_visible.size(), h);
+    h = hash_bytes(map.block_solid.data(), map.block_solid.size(), h);
+    for (const Tank &tank : battle.tank) {
+        h = hash_unit(tank, h);
+    }
+    for (const Bullet &bullet : battle.bullet) {
+        h = hash_unit(bullet, h);
+        int owner[2] = { static_cast<int>(bullet.owner_type), bullet.owner };
+        h = hash_bytes(owner, sizeof(owner), h);
+    }
+    h = hash_bytes(battle.bullet_live.data(), battle.bullet_live_num * sizeof(int), h);
+    h = hash_bytes(battle.bullet_free.data(), battle.bullet_free_num * sizeof(int), h);
+    h = hash_bytes(battle.tank_bullet_num.data(), battle.tank_bullet_num.size() * sizeof(int), h);
+    h = hash_bytes(&battle.enemy_num, sizeof(battle.enemy_num), h);
+    h = hash_bytes(&battle.enemy_left, sizeof(battle.enemy_left), h);
+
+    h = hash_bytes(coll_grid.head.data(), coll_grid.head.size() * sizeof(int), h);
+    h = hash_bytes(coll_grid.node.data(), coll_grid.node.size() * sizeof(Grid_Node), h);
+    h = hash_bytes(&coll_grid.free_node, sizeof(coll_grid.free_node), h);
+    h = hash_bytes(spatial_hash.slot.data(), spatial_hash.slot.size() * sizeof(Hash_Slot), h);
+    h = hash_bytes(spatial_hash.node.data(), spatial_hash.node.size() * sizeof(Grid_Node), h);
+    h = hash_bytes(&spatial_hash.free_node, sizeof(spatial_hash.free_node), h);
+    h = hash_bytes(sweep_list.entry.data(), sweep_list.entry.size() * sizeof(Sweep_Entry), h);
+    h = hash_bytes(rng.s, sizeof(rng.s), h);
+
+    int home_hit = is_home_hit ? 1 : 0;
+    h = hash_bytes(&home_hit, sizeof(home_hit), h);
+    h = hash_bytes(&tick, sizeof(tick), h);
+    return hash_bytes(last_firing_tick.data(), last_firing_tick.size() * sizeof(int64_t), h);
+}
+
+Unit *World::unit(int id)
+{
+    int idx = id & UNIT_ID_INDEX_MASK;
+    if ((id & ~UNIT_ID_INDEX_MASK) == UNIT_ID_TANK) {
+        return &battle.tank[idx];
+    }
+    assert((id & ~UNIT_ID_INDEX_MASK) == UNIT_ID_BULLET);
+    return &battle.bullet[idx];
+}
+
+const Unit *World::unit(int id) const
+{
+    int idx = id & UNIT_ID_INDEX_MASK;
+    if ((id & ~UNIT_ID_INDEX_MASK) == UNIT_ID_TANK) {
+        return &battle.tank[idx];
+    }
+    assert((id & ~UNIT_ID_INDEX_MASK) == UNIT_ID_BULLET);
+    return &battle.bullet[idx];
+}
+
+Unit_Handle World::handle(int id)
+{
+    Unit_Handle handle;
+    handle.id = id;
+    handle.generation = unit(id)->generation;
+    return handle;
+}
+
+Unit *World::unit(Unit_Handle handle)
+{
+    if (handle.id < UNIT_ID_TANK) {
+        return nullptr;
+    }
+    int idx = handle.id & UNIT_ID_INDEX_MASK;
+    int kind = handle.id & ~UNIT_ID_INDEX_MASK;
+    size_t num = kind == UNIT_ID_TANK ? battle.tank.size() :
+        kind == UNIT_ID_BULLET ? battle.bullet.size() : 0;
+    if (size_t(idx) >= num) {
+        return nullptr;
+    }
+
+    Unit *u = unit(handle.id);
+    if (u->generation != handle.generation || !u->is_visible) {
+        return nullptr;
+    }
+    return u;
+}
+
+Unit_Type World::unit_type(int id) const
+{
+    if (id < UNIT_ID_TANK) {
+        return static_cast<Unit_Type>(map.block_type[id]);
+    }
+    return unit(id)->type;
+}
+
+int World::check_collision(Unit &unit, int *ids, int max_num)
+{
+    int num = 0;
+    if (max_num > 0) {
+        for_each_collision(unit, [&](int id) {
+            ids[num++] = id;
+            return num < max_num;
+        });
+    }
+    return num;
+}
+
+// Units a tank can't drive into
+static bool is_tank_blocker(Unit_Type type)
+{
+    switch (type) {
+    case Unit_Type::tank_enemy:
+    case Unit_Type::tank_user:
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool World::on_tank_move(int i)
+{
+    //if (map.has_reached_edge(battle.tank[i])) {
+    //    return false;
+    //}
+
+    float step = TICK_TIME * TANK_MOVE_STEP;
+    Tank dummy = battle.tank[i];
+    dummy.move(step, map);
+
+    if (dummy.box_min == battle.tank[i].box_min && dummy.box_max == battle.tank[i].box_max) {
+        return false;
+    }
+
+    // Collision check: a few terrain bytes, then the units nearby up to the
+    // first one in the way
+    bool is_free = !map.is_blocked(dummy, BLOCK_STOPS_TANK) &&
+        for_each_collision(dummy, [&](int id) {
+            return !is_tank_blocker(unit_type(id));
+        });
+    if (!is_free) {
+        return false;
+    }
+
+    Tank before = battle.tank[i];
+    battle.tank[i].move(step, map);
+    broadphase_update(before, battle.tank[i]);
+
+    return true;
+}
+
+bool World::on_tank_move(int i, Direction direction)
+{
+    if (battle.tank[i].change_direction(direction) == false) {
+        return on_tank_move(i);
+    }
+
+    return true;
+}
+
+void World::on_bullet_firing(int i)
+{
+    // Each tank has a few bullets at a time, and can't fire too fast
+    if (tick - last_firing_tick[i] > FIRE_INTERVAL_TICKS) {
+        int slot = battle.spawn_bullet(i);
+        if (slot < 0) {
+            return;
+        }
+        battle.bullet[slot].init(battle.tank[i]);
+        broadphase_put(battle.bullet[slot]);
+
+        last_firing_tick[i] = tick;
+    }
+}
+
+void World::handle_user_tank(const Input &input)
+{
+    // Handle user tank movement
+    if (input.up) {
+        on_tank_move(0, Direction::up);
+    }
+    if (input.down) {
+        on_tank_move(0, Direction::down);
+    }
+    if (input.left) {
+        on_tank_move(0, Direction::left);
+    }
+    if (input.right) {
+        on_tank_move(0, Direction::right);
+    }
+
+    // Handle firing the bullet
+    if (input.fire) {
+        on_bullet_firing(0);
+    }
+}
+
+// Insert a hit, keeping the list sorted by distance and the nearest ones when full
+static void add_hit(Bullet_Hit *hits, int &hit_num, float distance, int id)
+{
+    int pos = hit_num;
+    if (hit_num == BULLET_HIT_MAX_NUM) {
+        if (distance >= hits[hit_num - 1].distance) {
+            return;
+        }
+        pos = hit_num - 1;
+    }
+    else {
+        hit_num++;
+    }
+
+    while (pos > 0 && hits[pos - 1].distance > distance) {
+        hits[pos] = hits[pos - 1];
+        pos--;
+    }
+    hits[pos].distance = distance;
+    hits[pos].id = id;
+}
+
+// How far the unit has to go forward to overlap the other one
+static float entry_distance(const Unit &unit, const Unit &other)
+{
+    float distance = 0.0f;
+    switch (unit.direction)
+    {
+    case Direction::up: distance = unit.box_min.y - other.box_max.y; break;
+    case Direction::down: distance = other.box_min.y - unit.box_max.y; break;
+    case Direction::left: distance = unit.box_min.x - other.box_max.x; break;
+    case Direction::right: distance = other.box_min.x - unit.box_max.x; break;
+    }
+    return std::max(0.0f, distance);
+}
+
+// Distance a unit moves along each axis for each unit it goes forward
+static glm::vec2 direction_step(Direction direction)
+{
+    switch (direction)
+    {
+    case Direction::up: return glm::vec2(0.0f, -1.0f);
+    case Direction::down: return glm::vec2(0.0f, 1.0f);
+    case Direction::left: return glm::vec2(-1.0f, 0.0f);
+    default: return glm::vec2(1.0f, 0.0f);
+    }
+}
+
+// How far a bullet goes before it meets another bullet flying at the same
+// speed, both moving, or -1 if they don't meet within max_dist. Computed the
+// same way from either side, so both get the contact at the same distance
+static float meet_distance(const Unit &bullet, const Unit &other, float max_dist)
+{
+    glm::vec2 closing = direction_step(bullet.direction) - direction_step(other.direction);
+    float enter = 0.0f;
+    float leave = max_dist;
+    for (int k = 0; k < 2; k++) {
+        // The bullet overlaps the other one along this axis once it has
+        // closed in by more than lo, until it has closed in by hi
+        float lo = other.box_min[k] - bullet.box_max[k];
+        float hi = other.box_max[k] - bullet.box_min[k];
+        if (closing[k] == 0.0f) {
+            if (lo >= 0.0f || hi <= 0.0f) {
+                return -1.0f;
+            }
+        }
+        else if (closing[k] > 0.0f) {
+            enter = std::max(enter, lo / closing[k]);
+            leave = std::min(leave, hi / closing[k]);
+        }
+        else {
+            enter = std::max(enter, hi / closing[k]);
+            leave = std::min(leave, lo / closing[k]);
+        }
+    }
+    return enter < leave ? enter : -1.0f;
+}
+
+// Units a bullet stops at; it flies over its own side's tanks
+static bool is_bullet_stopper(const Bullet &bullet, Unit_Type type)
+{
+    switch (type) {
+    case Unit_Type::bullet:
+        return true;
+    case Unit_Type::tank_enemy:
+        return bullet.owner_type == Unit_Type::tank_user;
+    case Unit_Type::tank_user:
+        return bullet.owner_type == Unit_Type::tank_enemy;
+    default:
+        return false;
+    }
+}
+
+int World::detect_bullet_contacts(int slot, float min_distance, Bullet_Contact *found) const
+{
+    const Bullet &bullet = battle.bullet[slot];
+    if (min_distance < 0.0f && map.has_reached_edge(bullet)) {
+        found[0].bullet = slot;
+        found[0].target = Unit_Handle();
+        found[0].distance = 0.0f;
+        return 1;
+    }
+
+    Bullet end = bullet;
+    end.move(TICK_TIME * BULLET_MOVE_STEP, map);
+    float dist = std::abs(end.box_min.x - bullet.box_min.x) +
+        std::abs(end.box_min.y - bullet.box_min.y);
+
+    // Sweep the whole path, so fast bullets and long ticks can't pass
+    // through anything: the first wall on the way, then what stops the
+    // bullet in the swept box before it
+    Bullet_Hit hits[BULLET_HIT_MAX_NUM];
+    int hit_num = 0;
+    int block_ids[4];
+    int block_num;
+    float wall_dist = map.sweep_solid_blocks(bullet, dist, BLOCK_STOPS_BULLET, block_ids, block_num);
+    for (int b = 0; b < block_num && wall_dist > min_distance; b++) {
+        add_hit(hits, hit_num, wall_dist, block_ids[b]);
+    }
+
+    // The tanks stand still during the pass, but the other bullets move as
+    // far as this one, so look for them that much further around the path
+    Unit path = bullet;
+    path.box_min = glm::min(bullet.box_min, end.box_min);
+    path.box_max = glm::max(bullet.box_max, end.box_max);
+    Unit reach = path;
+    reach.box_min -= glm::vec2(dist);
+    reach.box_max += glm::vec2(dist);
+    for_each_collision(reach, [&](int id) {
+        const Unit &other = *unit(id);
+        if (!other.is_visible || !is_bullet_stopper(bullet, other.type)) {
+            return true;
+        }
+        float distance = other.type == Unit_Type::bullet ? meet_distance(bullet, other, dist) :
+            path.is_overlap(other) ? entry_distance(bullet, other) : -1.0f;
+        if (distance >= 0.0f && distance > min_distance && distance <= wall_dist) {
+            add_hit(hits, hit_num, distance, id);
+        }
+        return true;
+    });
+
+    // Everything met first, at the same distance, is hit together
+    int found_num = 0;
+    for (; found_num < hit_num && hits[found_num].distance == hits[0].distance; found_num++) {
+        int id = hits[found_num].id;
+        found[found_num].bullet = slot;
+        found[found_num].target.id = id;
+        found[found_num].target.generation = id >= UNIT_ID_TANK ? unit(id)->generation : 0;
+        found[found_num].distance = hits[found_num].distance;
+    }
+    return found_num;
+}
+
+void World::handle_bullet_moving()
+{
+    // Detect what stops each bullet from the state at the start of the pass.
+    // Nothing changes yet, so no bullet sees the effects of another one
+    contacts.clear();
+    for (int k = 0; k < battle.bullet_live_num; k++) {
+        Bullet_Contact found[BULLET_HIT_MAX_NUM];
+        int found_num = detect_bullet_contacts(battle.bullet_live[k], -1.0f, found);
+        contacts.insert(contacts.end(), found, found + found_num);
+        bullet_stop_distance[battle.bullet_live[k]] = std::numeric_limits<float>::infinity();
+    }
+    std::fill(tank_hit_distance.begin(), tank_hit_distance.end(), std::numeric_limits<float>::infinity());
+    block_hits.clear();
+
+    // Resolve the contacts nearest first, as they happen during the tick,
+    // from a heap. A bullet shot down by another one before it gets to its
+    // own contacts leaves them untouched. A bullet whose target was taken out
+    // by another bullet before it got there flies on: what it meets further
+    // on is looked up again, from the world as it is now. Every other
+    // contact stops its bullet, and contacts at the same distance happen
+    // together, so their order does not matter; the bullet and target ids
+    // only make the order the same everywhere
+    auto later = [](const Bullet_Contact &a, const Bullet_Contact &b) {
+        return a.distance > b.distance || (a.distance == b.distance &&
+            (a.bullet > b.bullet || (a.bullet == b.bullet && a.target.id > b.target.id)));
+    };
+    std::make_heap(contacts.begin(), contacts.end(), later);
+    while (!contacts.empty()) {
+        std::pop_heap(contacts.begin(), contacts.end(), later);
+        Bullet_Contact contact = contacts.back();
+        contacts.pop_back();
+        if (bullet_stop_distance[contact.bullet] < contact.distance) {
+            continue;
+        }
+        if (is_contact_stale(contact)) {
+            Bullet_Contact found[BULLET_HIT_MAX_NUM];
+            int found_num = detect_bullet_contacts(contact.bullet, contact.distance, found);
+            for (int f = 0; f < found_num; f++) {
+                contacts.push_back(found[f]);
+                std::push_heap(contacts.begin(), contacts.end(), later);
+            }
+            continue;
+        }
+        bullet_stop_distance[contact.bullet] = contact.distance;
+        on_bullet_hit(battle.bullet[contact.bullet], contact);
+    }
+
+    // Move the bullets still flying; until now the broadphase held all the
+    // bullets where they started
+    for (int k = 0; k < battle.bullet_live_num; k++) {
+        Bullet &bullet = battle.bullet[battle.bullet_live[k]];
+        if (bullet.is_visible) {
+            Bullet start = bullet;
+            bullet.move(TICK_TIME * BULLET_MOVE_STEP, map);
+            broadphase_update(start, bullet);
+        }
+        else {
+            broadphase_remove(bullet);
+        }
+    }
+
+    // Return the bullets stopped this tick to the pool; going backwards, the
+    // bullet moved into a freed place has already been checked
+    for (int k = battle.bullet_live_num - 1; k >= 0; k--) {
+        int slot = battle.bullet_live[k];
+        if (!battle.bullet[slot].is_visible) {
+            battle.despawn_bullet(slot);
+        }
+    }
+}
+
+bool World::is_contact_stale(const Bullet_Contact &contact) const
+{
+    int id = contact.target.id;
+    if (id < 0) {
+        return false;
+    }
+    if (id < UNIT_ID_TANK) {
+        for (const Bullet_Hit &hit : block_hits) {
+            if (hit.id == id) {
+                return hit.distance < contact.distance;
+            }
+        }
+        return false;
+    }
+
+    int idx = id & UNIT_ID_INDEX_MASK;
+    const Unit *target = unit(id);
+    if (target->generation == contact.target.generation && target->is_visible) {
+        return false;
+    }
+    return (id & ~UNIT_ID_INDEX_MASK) == UNIT_ID_BULLET ? bullet_stop_distance[idx] < contact.distance :
+        tank_hit_distance[idx] < contact.distance;
+}
+
+void World::on_bullet_hit(Bullet &bullet, const Bullet_Contact &contact)
+{
+    // The target is still there, or was hit at the same time by another bullet
+    bullet.is_visible = false;
+
+    int id = contact.target.id;
+    if (id < 0) {
+        // Out of the map
+        return;
+    }
+    if (id < UNIT_ID_TANK) {
+        switch (unit_type(id))
+        {
+        case Unit_Type::brick:
+            if (map.block_visible[id]) {
+                map.destroy_block(id);
+                Bullet_Hit hit = { contact.distance, id };
+                block_hits.push_back(hit);
+            }
+            break;
+        case Unit_Type::home:
+            // The home is hit; game over
+            if (!is_home_hit) {
+                home_hit_owner = bullet.owner;
+            }
+            is_home_hit = true;
+            break;
+        default:
+            break;
+        }
+        return;
+    }
+
+    // Nothing more happens to a tank or a bullet hit by another bullet at
+    // the same time
+    Unit *target = unit(contact.target);
+    if (target == nullptr) {
+        return;
+    }
+    if (target->type != Unit_Type::bullet) {
+        float &hit_distance = tank_hit_distance[contact.target.id & UNIT_ID_INDEX_MASK];
+        hit_distance = std::min(hit_distance, contact.distance);
+    }
+    switch (target->type)
+    {
+    case Unit_Type::bullet:
+        // Taken out of the broadphase with the other stopped bullets; its own
+        // contacts further on are dropped
+        target->is_visible = false;
+        bullet_stop_distance[contact.target.id & UNIT_ID_INDEX_MASK] = contact.distance;
+        break;
+    case Unit_Type::tank_enemy:
+        target->is_visible = false;
+        broadphase_remove(*target);
+        battle.enemy_num -= 1;
+        battle.enemy_left -= 1;
+        break;
+    case Unit_Type::tank_user:
+        // The user is hit; reinitialized to the original position
+        broadphase_remove(*target);
+        battle.tank[0].init(Unit_Type::tank_user, map.rows - 1, map.user_spawn_col());
+        broadphase_put(battle.tank[0]);
+        break;
+    default:
+        break;
+    }
+}
+
+void World::handle_enemy_tanks()
+{
+    for (int i = 1; i < battle.tank_num(); i++) {
+        Tank &tank = battle.tank[i];
+        if (tank.is_visible) {
+            // Switch a direction if can't move
+            if (on_tank_move(i) == false) {
+                int r = rng.uniform(100);
+                if (r < 50 && tank.direction != Direction::down) {
+                    tank.change_direction(Direction::down);
+                }
+                else if (r < 70 && tank.direction != Direction::left) {
+                    tank.change_direction(Direction::left);
+                }
+                else if (r < 90 && tank.direction != Direction::right) {
+                    tank.change_direction(Direction::right);
+                }
+                else if (tank.direction != Direction::up) {
+                    tank.change_direction(Direction::up);
+                }
+                else {
+                    tank.change_direction(Direction::down);
+                }
+            }
+
+            // Fire a bullet
+            if (rng.uniform(1024) < 10) {
+                on_bullet_firing(i);
+            }
+        } else if (battle.enemy_num < battle.enemy_max && battle.enemy_num < battle.enemy_left) {
+            // Make a new enemy at one of a few spawn points, starting from a random one
+            int spawn_num = int(battle.spawn_block.size());
+            int pos = rng.uniform(spawn_num);
+            int try_num = std::min(spawn_num, 3);
+            Tank dummy[3];
+            const Unit *spots[3];
+            for (int i = 0; i < try_num; i++) {
+                int block = battle.spawn_block[(pos + i) % spawn_num];
+                // Each try starts from the last one, as init bumps the generation
+                dummy[i] = i > 0 ? dummy[i - 1] : tank;
+                dummy[i].init(Unit_Type::tank_enemy, block / map.cols, block % map.cols);
+                dummy[i].change_direction(Direction::down);
+                spots[i] = &dummy[i];
+            }
+
+            // Check if there is a wall on the reborn places, all at once, then
+            // a tank in the first one clear
+            uint64_t walled = map.blocked_units(spots, try_num, BLOCK_STOPS_TANK);
+            for (int i = 0; i < try_num; i++) {
+                bool check_failed = ((walled >> i) & 1) != 0 ||
+                    !for_each_collision(dummy[i], [&](int id) {
+                        return !is_tank_blocker(unit_type(id));
+                    });
+
+                if (check_failed) {
+                    continue;
+                }
+                else {
+                    tank = dummy[i];
+                    broadphase_put(tank);
+                    battle.enemy_num += 1;
+                    break;
+                }
+            }
+        }
+    }
+}
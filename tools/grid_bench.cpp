@@ -0,0 +1,362 @@
+// Local Headers
+#include "overlap.hpp"
+#include "rng.hpp"
+#include "types.hpp"
+#include "world.hpp"
+
+// Standard Headers
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <set>
+#include <vector>
+
+// Heap allocations made by the whole program, to check the grids against
+static long allocation_num = 0;
+
+void *operator new(size_t size)
+{
+    allocation_num++;
+    void *p = malloc(size ? size : 1);
+    if (p == nullptr) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// The grid as it was before the flat storage: a tree of unit pointers per cell
+class Tree_Grid
+{
+public:
+    int rows = 0;
+    int cols = 0;
+    std::vector<std::map<int, Unit*>> grid;
+
+    void init(int rows, int cols)
+    {
+        this->rows = rows;
+        this->cols = cols;
+        grid.assign(size_t(rows) * cols, std::map<int, Unit*>());
+    }
+
+    int get_grid_index(float x, float y)
+    {
+        int i = std::max(0, std::min(int(y / BLOCK_WIDTH), rows - 1));
+        int j = std::max(0, std::min(int(x / BLOCK_WIDTH), cols - 1));
+        return i * cols + j;
+    }
+
+    std::set<int> get_grids_touched(Unit &unit)
+    {
+        std::set<int> grids_touched;
+        grids_touched.insert(get_grid_index(unit.box_min.x, unit.box_min.y));
+        grids_touched.insert(get_grid_index(unit.box_min.x, unit.box_max.y));
+        grids_touched.insert(get_grid_index(unit.box_max.x, unit.box_min.y));
+        grids_touched.insert(get_grid_index(unit.box_max.x, unit.box_max.y));
+        return grids_touched;
+    }
+
+    void put(Unit &unit)
+    {
+        for (int grid_idx : get_grids_touched(unit)) {
+            grid[grid_idx][unit.id] = &unit;
+        }
+    }
+
+    void remove(Unit &unit)
+    {
+        for (int grid_idx : get_grids_touched(unit)) {
+            grid[grid_idx].erase(unit.id);
+        }
+    }
+
+    std::vector<Unit*> check_collision(Unit &unit)
+    {
+        std::vector<Unit*> unit_collides;
+        for (int grid_idx : get_grids_touched(unit)) {
+            for (std::pair<int, Unit*> kv : grid[grid_idx]) {
+                if (unit.id != kv.first && unit.is_overlap(*kv.second)) {
+                    unit_collides.push_back(kv.second);
+                }
+            }
+        }
+        return unit_collides;
+    }
+};
+
+struct Bench_Result
+{
+    double ns_per_update;
+    double allocations_per_update;
+    long overlaps;
+};
+
+// Tanks scattered over a square map, about one per eight blocks
+static void make_units(int unit_num, int side, std::vector<Tank> &tanks)
+{
+    Rng rng;
+    rng.seed(unit_num);
+    tanks.assign(unit_num, Tank());
+    for (int i = 0; i < unit_num; i++) {
+        tanks[i].id = UNIT_ID_TANK + i;
+        tanks[i].init(Unit_Type::tank_enemy, rng.uniform(side), rng.uniform(side));
+        tanks[i].change_direction(static_cast<Direction>(rng.uniform(4)));
+    }
+}
+
+// Move a tank one tick, turning at the edges of the map
+static void step_unit(Tank &tank, Map &map, Rng &rng)
+{
+    if (map.has_reached_edge(tank)) {
+        tank.change_direction(static_cast<Direction>(rng.uniform(4)));
+    }
+    tank.move(TICK_TIME * TANK_MOVE_STEP, map);
+}
+
+// Each update removes a unit, moves it, puts it back and queries what it overlaps
+template<typename Update>
+static Bench_Result run(int unit_num, int round_num, Update update)
+{
+    int side = std::max(16, int(std::sqrt(unit_num * 8.0)));
+    Map map;
+    map.rows = side;
+    map.cols = side;
+
+    std::vector<Tank> tanks;
+    make_units(unit_num, side, tanks);
+    Rng rng;
+    rng.seed(1);
+
+    Bench_Result result = { 0.0, 0.0, 0 };
+    update(map, tanks, rng, -1, result.overlaps);
+
+    long allocations = allocation_num;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < round_num; r++) {
+        for (int i = 0; i < unit_num; i++) {
+            update(map, tanks, rng, i, result.overlaps);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double update_num = double(round_num) * unit_num;
+    result.ns_per_update = std::chrono::duration<double, std::nano>(end - start).count() / update_num;
+    result.allocations_per_update = (allocation_num - allocations) / update_num;
+    return result;
+}
+
+// A broadphase on tanks scattered over a spread x spread corner of a square
+// map: each update moves a tank, updates the index and counts the candidates
+// the index returns for it
+template<typename Index, typename Init>
+static Bench_Result run_broadphase(Index &index, Init init, int unit_num, int map_side, int spread,
+    int round_num)
+{
+    Map map;
+    map.rows = map_side;
+    map.cols = map_side;
+
+    std::vector<Tank> tanks;
+    make_units(unit_num, spread, tanks);
+    Rng rng;
+    rng.seed(1);
+
+    init(index, map, unit_num);
+    for (Tank &tank : tanks) {
+        index.put(tank, false);
+    }
+
+    Bench_Result result = { 0.0, 0.0, 0 };
+    long allocations = allocation_num;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < round_num; r++) {
+        for (int i = 0; i < unit_num; i++) {
+            Tank before = tanks[i];
+            step_unit(tanks[i], map, rng);
+            index.update(before, tanks[i]);
+            index.query(tanks[i], [&](int) {
+                result.overlaps++;
+                return true;
+            });
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double update_num = double(round_num) * unit_num;
+    result.ns_per_update = std::chrono::duration<double, std::nano>(end - start).count() / update_num;
+    result.allocations_per_update = (allocation_num - allocations) / update_num;
+    return result;
+}
+
+// Compares the flat collision grid with the tree based one it replaced, then
+// the broadphases across densities
+int main(int argc, char *argv[])
+{
+    std::vector<int> unit_nums = { 100, 1000, 10000 };
+    long update_num = 2000000;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--updates") == 0 && i + 1 < argc) {
+            update_num = std::max(1L, atol(argv[++i]));
+        }
+        else {
+            printf("Usage: grid_bench [--updates N]\n");
+            return EXIT_FAILURE;
+        }
+    }
+
+    printf("%8s %-7s %-6s %12s %14s %10s\n", "units", "map", "grid", "ns/update", "allocs/update", "overlaps");
+    for (int unit_num : unit_nums) {
+        int round_num = int(std::max(1L, update_num / unit_num));
+        int side = std::max(16, int(std::sqrt(unit_num * 8.0)));
+
+        Tree_Grid tree_grid;
+        Bench_Result tree = run(unit_num, round_num,
+            [&](Map &map, std::vector<Tank> &tanks, Rng &rng, int i, long &overlaps) {
+                if (i < 0) {
+                    tree_grid.init(map.rows, map.cols);
+                    for (Tank &tank : tanks) {
+                        tree_grid.put(tank);
+                    }
+                    return;
+                }
+                tree_grid.remove(tanks[i]);
+                step_unit(tanks[i], map, rng);
+                tree_grid.put(tanks[i]);
+                overlaps += long(tree_grid.check_collision(tanks[i]).size());
+            });
+
+        Collision_Grid flat_grid;
+        Bench_Result flat = run(unit_num, round_num,
+            [&](Map &map, std::vector<Tank> &tanks, Rng &rng, int i, long &overlaps) {
+                if (i < 0) {
+                    flat_grid.init(map.rows, map.cols, 4 * int(tanks.size()));
+                    for (Tank &tank : tanks) {
+                        flat_grid.put(tank, false);
+                    }
+                    return;
+                }
+                flat_grid.remove(tanks[i], false);
+                step_unit(tanks[i], map, rng);
+                flat_grid.put(tanks[i], false);
+
+                int cells[4];
+                int cell_num = flat_grid.get_cells_touched(tanks[i], false, cells);
+                for (int c = 0; c < cell_num; c++) {
+                    for (int n = flat_grid.head[cells[c]]; n >= 0; n = flat_grid.node[n].next) {
+                        int id = flat_grid.node[n].id;
+                        if (id != tanks[i].id && tanks[i].is_overlap(tanks[id & UNIT_ID_INDEX_MASK])) {
+                            overlaps++;
+                        }
+                    }
+                }
+            });
+
+        printf("%8d %3dx%-3d %-6s %12.1f %14.2f %10ld\n", unit_num, side, side, "tree",
+            tree.ns_per_update, tree.allocations_per_update, tree.overlaps);
+        printf("%8d %3dx%-3d %-6s %12.1f %14.2f %10ld\n", unit_num, side, side, "flat",
+            flat.ns_per_update, flat.allocations_per_update, flat.overlaps);
+    }
+
+    // From one tank per eight blocks to a battle packed sixteen to a block
+    struct Scenario
+    {
+        const char *name;
+        int map_side;
+        int spread;
+    };
+    Scenario scenarios[] = {
+        { "sparse", 283, 283 },
+        { "dense", 100, 100 },
+        { "clustered", 1000, 25 },
+    };
+    int bench_num = 10000;
+    int bench_rounds = int(std::max(1L, update_num / bench_num));
+
+    printf("\nBroadphases, %d tanks:\n", bench_num);
+    printf("%-10s %11s %-6s %12s %16s\n", "scenario", "tanks/block", "index", "ns/update", "candidates/query");
+    for (const Scenario &scenario : scenarios) {
+        double density = double(bench_num) / (double(scenario.spread) * scenario.spread);
+
+        Collision_Grid grid;
+        Bench_Result grid_result = run_broadphase(grid, [](Collision_Grid &index, Map &map, int unit_num) {
+            index.init(map.rows, map.cols, 4 * unit_num);
+        }, bench_num, scenario.map_side, scenario.spread, bench_rounds);
+
+        Spatial_Hash hash;
+        Bench_Result hash_result = run_broadphase(hash, [](Spatial_Hash &index, Map &map, int unit_num) {
+            index.init(map.rows, map.cols, 2, 4 * unit_num);
+        }, bench_num, scenario.map_side, scenario.spread, bench_rounds);
+
+        Sweep_List sweep;
+        Bench_Result sweep_result = run_broadphase(sweep, [](Sweep_List &index, Map &, int unit_num) {
+            index.init(unit_num);
+        }, bench_num, scenario.map_side, scenario.spread, bench_rounds);
+
+        const char *names[] = { "grid", "hash", "sweep" };
+        const Bench_Result *results[] = { &grid_result, &hash_result, &sweep_result };
+        for (int k = 0; k < 3; k++) {
+            printf("%-10s %11.3f %-6s %12.1f %16.2f\n", scenario.name, density, names[k],
+                results[k]->ns_per_update, results[k]->overlaps / (double(bench_rounds) * bench_num));
+        }
+    }
+
+    // Narrow phase: each unit against a full batch of others, one box at a
+    // time and with the batched kernel
+    std::vector<Tank> tanks;
+    int unit_num = 10000;
+    make_units(unit_num, int(std::sqrt(unit_num / 4.0)), tanks);
+    int test_num = int(std::max(1L, update_num / OVERLAP_BATCH_MAX));
+
+    long scalar_hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int t = 0; t < test_num; t++) {
+        const Tank &tank = tanks[t % unit_num];
+        for (int k = 1; k <= OVERLAP_BATCH_MAX; k++) {
+            scalar_hits += tank.is_overlap(tanks[(t + k) % unit_num]) ? 1 : 0;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    double scalar_ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+    long batch_hits = 0;
+    Box_Batch batch;
+    start = std::chrono::steady_clock::now();
+    for (int t = 0; t < test_num; t++) {
+        const Tank &tank = tanks[t % unit_num];
+        batch.num = 0;
+        for (int k = 1; k <= OVERLAP_BATCH_MAX; k++) {
+            const Tank &other = tanks[(t + k) % unit_num];
+            batch.add(other.box_min, other.box_max);
+        }
+        batch.pad();
+        uint32_t hits = overlap_batch(tank.box_min, tank.box_max, batch);
+        for (; hits != 0; hits &= hits - 1) {
+            batch_hits++;
+        }
+    }
+    end = std::chrono::steady_clock::now();
+    double batch_ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+    double box_num = double(test_num) * OVERLAP_BATCH_MAX;
+    printf("\nNarrow phase, %d boxes per batch (gathering included):\n", OVERLAP_BATCH_MAX);
+    printf("  one at a time: %6.2f ns/box, %ld hits\n", scalar_ns / box_num, scalar_hits);
+    printf("  batched:       %6.2f ns/box, %ld hits\n", batch_ns / box_num, batch_hits);
+
+    return EXIT_SUCCESS;
+}
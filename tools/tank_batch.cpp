@@ -0,0 +1,170 @@
+// Local Headers
+#include "thread_pool.hpp"
+#include "world.hpp"
+
+// Standard Headers
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+enum class Match_Outcome
+{
+    win = 0,
+    loss = 1,
+    timeout = 2,
+};
+
+struct Match_Result
+{
+    Match_Outcome outcome;
+    // For a loss, whether the user's own bullet destroyed the home
+    bool is_own_fire;
+    int64_t ticks;
+    int enemies_destroyed;
+};
+
+void print_usage()
+{
+    printf("Usage: tank_batch [--matches N] [--threads N] [--seed S] [--max-ticks N]\n");
+    printf("                  [--enemies N] [--enemy-total N] [--bullets N]\n");
+    printf("                  [--broadphase grid|hash|sweep] [--hash-cell N]\n");
+    printf("                  [--idle] [--map FILE]...\n");
+    printf("The user tank is driven by random keys, holding its fire while the home\n");
+    printf("is in line; with --idle it stays put. Neither defends the home, so most\n");
+    printf("matches are lost to enemy fire\n");
+}
+
+// Runs many independent headless matches on all cores and aggregates the outcomes
+int main(int argc, char *argv[])
+{
+    int match_num = 1000;
+    int thread_num = 0;
+    uint64_t base_seed = 0;
+    int64_t max_ticks = 5 * 60 * TICKS_PER_SECOND;
+    bool idle = false;
+    World_Config config;
+    std::vector<std::string> map_files;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--matches") == 0 && i + 1 < argc) {
+            match_num = std::max(0, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_num = std::max(0, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            base_seed = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--max-ticks") == 0 && i + 1 < argc) {
+            max_ticks = atoll(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--enemies") == 0 && i + 1 < argc) {
+            config.enemy_num = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--enemy-total") == 0 && i + 1 < argc) {
+            config.enemy_total = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--bullets") == 0 && i + 1 < argc) {
+            config.bullet_num = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--broadphase") == 0 && i + 1 < argc) {
+            if (!parse_broadphase(argv[++i], config.broadphase)) {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--hash-cell") == 0 && i + 1 < argc) {
+            config.hash_cell_size = std::max(1, std::min(MAP_MAX_SIZE, atoi(argv[++i])));
+        }
+        else if (strcmp(argv[i], "--idle") == 0) {
+            idle = true;
+        }
+        else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc) {
+            map_files.push_back(argv[++i]);
+        }
+        else {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+    if (map_files.empty()) {
+        map_files.push_back("../res/map.txt");
+    }
+
+    // Load every map once; each match starts from a copy of its freshly set up world
+    std::vector<World> prototypes(map_files.size());
+    for (size_t m = 0; m < map_files.size(); m++) {
+        if (!prototypes[m].init(map_files[m], 0, config)) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    std::vector<Match_Result> results(match_num);
+    Work_Stealing_Pool pool(thread_num);
+
+    auto start = std::chrono::steady_clock::now();
+    pool.run(match_num, [&](int i, int) {
+        uint64_t seed = base_seed + uint64_t(i);
+        World world;
+        world.clone_from(prototypes[i % prototypes.size()]);
+        world.rng.seed(seed);
+
+        Random_Player player;
+        player.seed(~seed);
+        Input input;
+
+        while (!world.is_over() && world.tick < max_ticks) {
+            if (!idle) {
+                input = player.next();
+                input.fire = input.fire && !world.is_home_in_line(input);
+            }
+            world.step(input);
+        }
+
+        Match_Result &result = results[i];
+        result.outcome = world.is_home_hit ? Match_Outcome::loss :
+            world.battle.enemy_left <= 0 ? Match_Outcome::win : Match_Outcome::timeout;
+        result.is_own_fire = world.home_hit_owner == 0;
+        result.ticks = world.tick;
+        result.enemies_destroyed = world.battle.enemy_total - world.battle.enemy_left;
+    });
+    auto end = std::chrono::steady_clock::now();
+
+    int outcomes[3] = { 0, 0, 0 };
+    int own_fire_losses = 0;
+    int64_t total_ticks = 0;
+    int64_t total_destroyed = 0;
+    for (const Match_Result &result : results) {
+        outcomes[static_cast<int>(result.outcome)]++;
+        if (result.outcome == Match_Outcome::loss && result.is_own_fire) {
+            own_fire_losses++;
+        }
+        total_ticks += result.ticks;
+        total_destroyed += result.enemies_destroyed;
+    }
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    int steals = 0;
+    for (int w = 0; w < pool.thread_num; w++) {
+        steals += pool.jobs_stolen[w];
+    }
+
+    printf("Matches: %d on %d threads (%d stolen)\n", match_num, pool.thread_num, steals);
+    printf("Wins: %d, losses: %d, timeouts: %d\n", outcomes[0], outcomes[1], outcomes[2]);
+    printf("Losses to own fire: %d, to enemy fire: %d\n", own_fire_losses, outcomes[1] - own_fire_losses);
+    if (match_num > 0) {
+        printf("Average ticks per match: %.0f\n", double(total_ticks) / match_num);
+        printf("Average enemies destroyed: %.2f\n", double(total_destroyed) / match_num);
+    }
+    printf("Time: %.3f s\n", seconds);
+    if (seconds > 0.0) {
+        printf("Matches per second: %.1f\n", match_num / seconds);
+        printf("Ticks per second: %.0f\n", total_ticks / seconds);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,192 @@
+// Local Headers
+#include "replay.hpp"
+#include "world.hpp"
+
+// Standard Headers
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+void print_usage()
+{
+    printf("Usage: tank_sim [--ticks N] [--seed S] [--map FILE] [--random-input]\n");
+    printf("                [--enemies N] [--enemy-total N] [--bullets N]\n");
+    printf("                [--broadphase grid|hash|sweep] [--hash-cell N]\n");
+    printf("                [--record FILE] [--hash-interval N]\n");
+    printf("       tank_sim --replay FILE [--map FILE]\n");
+}
+
+// Plays a recorded match as fast as possible and checks the state hashes
+int play_replay(std::string replay_file, std::string map_file)
+{
+    Replay replay;
+    if (!replay.load(replay_file)) {
+        return EXIT_FAILURE;
+    }
+
+    World world;
+    if (!world.init(map_file, replay.seed, replay.config)) {
+        return EXIT_FAILURE;
+    }
+    if (world.map.hash() != replay.map_hash) {
+        fprintf(stderr, "The replay was recorded on a different map than %s\n", map_file.c_str());
+        return EXIT_FAILURE;
+    }
+
+    int64_t desync_tick = -1;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned char bits : replay.inputs) {
+        world.step(Input::from_bits(bits));
+
+        uint32_t expected;
+        if (replay.expected_hash(world.tick, expected) && uint32_t(world.hash()) != expected) {
+            desync_tick = world.tick;
+            break;
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    printf("Seed: %llu\n", (unsigned long long)replay.seed);
+    printf("Ticks: %lld / %zu\n", (long long)world.tick, replay.inputs.size());
+    printf("Time: %.3f s\n", seconds);
+    printf("Ticks per second: %.0f\n", seconds > 0.0 ? world.tick / seconds : 0.0);
+
+    if (desync_tick >= 0) {
+        printf("Desync: state hash mismatch at tick %lld\n", (long long)desync_tick);
+        return EXIT_FAILURE;
+    }
+    printf("Replay verified: %zu state hashes match\n", replay.hashes.size());
+    return EXIT_SUCCESS;
+}
+
+// Runs the game logic without a window and reports the simulation throughput
+int main(int argc, char *argv[])
+{
+    long ticks = 100000;
+    uint64_t seed = 0;
+    std::string map_file = "../res/map.txt";
+    std::string record_file, replay_file;
+    int hash_interval = 1;
+    bool random_input = false;
+    World_Config config;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--ticks") == 0 && i + 1 < argc) {
+            ticks = atol(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
+        }
+        else if (strcmp(argv[i], "--map") == 0 && i + 1 < argc) {
+            map_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--random-input") == 0) {
+            random_input = true;
+        }
+        else if (strcmp(argv[i], "--enemies") == 0 && i + 1 < argc) {
+            config.enemy_num = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--enemy-total") == 0 && i + 1 < argc) {
+            config.enemy_total = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--bullets") == 0 && i + 1 < argc) {
+            config.bullet_num = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--broadphase") == 0 && i + 1 < argc) {
+            if (!parse_broadphase(argv[++i], config.broadphase)) {
+                print_usage();
+                return EXIT_FAILURE;
+            }
+        }
+        else if (strcmp(argv[i], "--hash-cell") == 0 && i + 1 < argc) {
+            config.hash_cell_size = std::max(1, std::min(MAP_MAX_SIZE, atoi(argv[++i])));
+        }
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_file = argv[++i];
+        }
+        else if (strcmp(argv[i], "--hash-interval") == 0 && i + 1 < argc) {
+            hash_interval = std::max(1, atoi(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_file = argv[++i];
+        }
+        else {
+            print_usage();
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!replay_file.empty()) {
+        return play_replay(replay_file, map_file);
+    }
+
+    World world;
+    if (!world.init(map_file, seed, config)) {
+        return EXIT_FAILURE;
+    }
+
+    Replay replay;
+    replay.start(world, seed, hash_interval);
+
+    Random_Player player;
+    player.seed(~seed);
+    Input input;
+
+    // Leave out the grid writes of the initial placement
+    int64_t grid_writes = world.broadphase_stats().write_num;
+
+    auto start = std::chrono::steady_clock::now();
+    for (long i = 0; i < ticks; i++) {
+        if (random_input) {
+            input = player.next();
+        }
+        world.step(input);
+        if (!record_file.empty()) {
+            replay.record(input, world);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double seconds = std::chrono::duration<double>(end - start).count();
+    printf("Seed: %llu\n", (unsigned long long)seed);
+    printf("Tanks: %d\n", world.battle.tank_num());
+    printf("Ticks: %ld\n", ticks);
+    printf("Simulated time: %.1f s\n", ticks * TICK_TIME);
+    printf("Time: %.3f s\n", seconds);
+    printf("Ticks per second: %.0f\n", seconds > 0.0 ? ticks / seconds : 0.0);
+    printf("Enemies left: %d, home hit: %s\n",
+        world.battle.enemy_left, world.is_home_hit ? "yes" : "no");
+    Broadphase_Stats stats = world.broadphase_stats();
+    printf("Broadphase: %s, %zu KiB\n", broadphase_name(world.config.broadphase), stats.bytes / 1024);
+    if (ticks > 0) {
+        grid_writes = stats.write_num - grid_writes;
+        int64_t saved = stats.saved_write_num;
+        printf("Grid writes per tick: %.1f, %.1f saved (%.0f%%)\n", double(grid_writes) / ticks,
+            double(saved) / ticks, 100.0 * saved / std::max<int64_t>(1, grid_writes + saved));
+    }
+
+    if (!record_file.empty() && !replay.save(record_file)) {
+        return EXIT_FAILURE;
+    }
+
+    // Cost of capturing and restoring the world state, about 1 GB of copies in total
+    World_Snapshot snapshot;
+    world.save(snapshot);
+    const int rounds = int(std::max<size_t>(1, std::min<size_t>(100000, (1 << 30) / snapshot.data.size())));
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; i++) {
+        world.save(snapshot);
+        if (!world.restore(snapshot)) {
+            return EXIT_FAILURE;
+        }
+    }
+    end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / rounds;
+    printf("Snapshot: %zu bytes, save + restore %.0f ns\n", snapshot.data.size(), ns);
+
+    return EXIT_SUCCESS;
+}